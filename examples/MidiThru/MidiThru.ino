@@ -0,0 +1,37 @@
+/*
+  MidiThru.ino
+  ------------
+  Use the board as a sound module: notes played on an external keyboard
+  (connected to MIDI-IN on Serial2) are played by the VS1053.
+*/
+
+#include <Arduino.h>
+#include "pins.h"
+#include "MIDI_VS1053.h"
+
+VS1053_MIDI midi;
+MidiInput midiIn(midi, Serial2);
+
+void setup() {
+    Serial.begin(115200);
+    midi.begin();
+    midi.setMasterVolume(110);
+    midi.setReverb(60);
+
+    // Start with a piano on every channel the keyboard may use
+    for (uint8_t ch = 0; ch < 16; ch++) {
+        if (ch != 9) midi.setInstrument(ch, Instrument::AcousticGrandPiano);
+    }
+
+    midiIn.begin(MIDI_IN_RX);
+
+    // Pass everything except clock/system messages through.
+    // setChannelMap(in, out) moves an input channel to another VS1053 channel,
+    // setThruChannels(mask) ignores the channels that are not in mask.
+    midiIn.setThruFilter(MIDI_THRU_ALL & ~MIDI_THRU_SYSTEM);
+}
+
+void loop() {
+    midiIn.update(); // read MIDI-IN and forward to the VS1053
+    midi.update();
+}
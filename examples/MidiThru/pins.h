@@ -0,0 +1,12 @@
+#pragma once
+
+#define VS1053_CS 2
+#define VS1053_DCS 4
+#define VS1053_DREQ 36
+#define VS1053_MOSI 23
+#define VS1053_MISO 19
+#define VS1053_SCK 18
+#define VS1053_RESET 5
+
+// MIDI-IN: UART RX pin (through the usual 6N138 opto-coupler circuit)
+#define MIDI_IN_RX 16
@@ -13,61 +13,40 @@ VS1053_MIDI midi;
 // Time of the last chord played (used to space chords)
 unsigned long lastTime = 0;
 
-// There are 3 channels used: 0, 1, 2
-// We track what instrument is currently set on each channel so we
-// don't call setInstrument() repeatedly and cause duplicated notes.
-//
-// Initialize to 255 which is an impossible instrument number (valid are 0..127).
-uint8_t currentInstrument[3] = {255, 255, 255};
+// All chord notes are played on channel 0. The library remembers which
+// instrument is set on each channel, so a Program Change is only sent
+// when the instrument really changes.
+const uint8_t CHORD_CHANNEL = 0;
+
+// Delay between the chord notes in milliseconds (0 = all notes at once).
+// A few milliseconds makes the chord sound "strummed" like on a guitar
+// (see examples/StrummedChords for a strum spread over the stereo field).
+const uint32_t STRUM_MS = 0;
 
 
 // ------------------------------------------------------------
 // playChord()
-// Plays a major triad (root, root + 4, root + 7) using three channels.
+// Plays a major triad (root, root + 4, root + 7) on one channel.
 // - rootNote: MIDI note number for the chord root (0..127)
 // - inst: instrument number (General MIDI 0..127)
 // - durationMs: how long each note should sound in milliseconds
 //
 // This function:
-//  1. Ensures each channel has the correct instrument set, but only
-//     calls setInstrument() if the instrument changed since last time.
-//  2. Sets stereo pan for each channel so the chord is spread across
-//     left -> center -> right.
-//  3. Calls playNoteAsync() to play notes in a non-blocking way.
+//  1. Builds the three chord notes from the root.
+//  2. Calls playChordAsync() once. The library sends the instrument and
+//     all Note On messages in one fast SPI burst (or strummed, see
+//     STRUM_MS) and schedules all Note Offs itself - no waiting here.
 // ------------------------------------------------------------
 void playChord(uint8_t rootNote, Instrument inst, uint32_t durationMs) {
-  // We will use three channels for the chord: left, center, right
-  uint8_t channels[3] = {0, 1, 2};
-
-  // Pan values in MIDI range 0..127. 32 = left, 64 = center, 96 = right.
-  uint8_t pans[3] = {32, 64, 96};
-
   // Intervals for a major triad (in semitones): root, major third, perfect fifth
   int intervals[3] = {0, 4, 7};
 
+  Note notes[3];
   for (int i = 0; i < 3; i++) {
-    uint8_t ch = channels[i];
-
-    // Only call setInstrument() if the requested instrument is different
-    // from what we last set on this channel. This avoids duplicate calls.
-    if (currentInstrument[i] != (uint8_t)inst) {
-      // Debug print so the user can see when we actually change instrument
-      Serial.printf("[DEBUG] setInstrument called for channel %d -> instrument %d\n", ch, (int)inst);
-
-      midi.setInstrument(ch, inst);       // Set instrument on this channel
-      currentInstrument[i] = (uint8_t)inst; // Remember instrument for this channel
-    }
-
-    // Set stereo pan for this channel (left/center/right)
-    midi.setPan(ch, pans[i]);
-
-    // Play the note asynchronously (non-blocking).
-    // Note: we still pass the instrument to playNoteAsync() because
-    // some library versions require it. If your library has an overload
-    // without instrument, you could use that instead.
-    uint8_t note = (uint8_t)(rootNote + intervals[i]);
-    midi.playNoteAsync(ch, inst, (Note)note, durationMs);
+    notes[i] = (Note)(rootNote + intervals[i]);
   }
+
+  midi.playChordAsync(CHORD_CHANNEL, inst, notes, 3, durationMs, 110, STRUM_MS);
 }
 
 
@@ -94,6 +73,9 @@ void setup() {
   // Simple effects - reverb and bass boost
   midi.setReverb(80);    // Adds ambient reverb effect
   midi.setBassBoost(10); // Adds a bit of low-frequency punch
+
+  // Put the chord channel in the middle of the stereo field
+  midi.setPan(CHORD_CHANNEL, 64);
 }
 
 
@@ -0,0 +1,135 @@
+/*
+  StrummedChords.ino
+  ------------------
+  Play random major chords using VS1053 in MIDI mode, strummed like on a
+  guitar: each chord note starts a few milliseconds after the previous one,
+  on its own channel, panned left -> center -> right.
+*/
+
+#include <Arduino.h>
+#include <MIDI_VS1053.h>
+
+// Create the VS1053 MIDI controller object
+VS1053_MIDI midi;
+
+// Time of the last chord played (used to space chords)
+unsigned long lastTime = 0;
+
+// There are 3 channels used: 0, 1, 2, one per chord note, panned
+// left -> center -> right so the chord is spread across the stereo field.
+// The library remembers which instrument is set on each channel, so a
+// Program Change is only sent when the instrument really changes.
+const uint8_t CHANNELS[3] = {0, 1, 2};
+
+// Pan values in MIDI range 0..127. 32 = left, 64 = center, 96 = right.
+const uint8_t PANS[3] = {32, 64, 96};
+
+// Delay between the chord notes in milliseconds.
+const uint32_t STRUM_MS = 8;
+
+
+// ------------------------------------------------------------
+// playChord()
+// Strums a major triad (root, root + 4, root + 7) over three channels.
+// - rootNote: MIDI note number for the chord root (0..127)
+// - inst: instrument number (General MIDI 0..127)
+// - durationMs: how long each note should sound in milliseconds
+//
+// This function:
+//  1. Builds the three chord notes from the root.
+//  2. Queues note i on channel i, i * STRUM_MS after now, with
+//     playNoteAt(). The library sets the instruments, sends the notes
+//     due in the same update() in one SPI burst and schedules all Note
+//     Offs itself - no waiting here.
+// For a chord on a single channel, playChordAsync() does the same in
+// one call: midi.playChordAsync(0, inst, notes, 3, durationMs, 110, STRUM_MS);
+// ------------------------------------------------------------
+void playChord(uint8_t rootNote, Instrument inst, uint32_t durationMs) {
+  // Intervals for a major triad (in semitones): root, major third, perfect fifth
+  int intervals[3] = {0, 4, 7};
+
+  uint32_t now = micros();
+  for (int i = 0; i < 3; i++) {
+    Note note = (Note)(rootNote + intervals[i]);
+    midi.playNoteAt(now + i * STRUM_MS * 1000, CHANNELS[i], inst, note, durationMs, 110);
+  }
+}
+
+
+// ------------------------------------------------------------
+// setup()
+// Initialization: serial + MIDI begin + some simple audio settings
+// ------------------------------------------------------------
+void setup() {
+  Serial.begin(115200);
+  while (!Serial) {
+    ; // Wait for Serial to be ready if board requires it (harmless if not)
+  }
+
+  // Initialize the MIDI interface for VS1053
+  midi.begin();
+
+  // Enable debug output from the library (useful while developing)
+  midi.setDebug(true);
+
+  // Global sound settings (tweak as you like)
+  // Master volume typically 0..127 (smaller number = softer)
+  midi.setMasterVolume(100);
+
+  // Simple effects - reverb and bass boost
+  midi.setReverb(80);    // Adds ambient reverb effect
+  midi.setBassBoost(10); // Adds a bit of low-frequency punch
+
+  // Spread the chord channels across the stereo field (left/center/right)
+  for (int i = 0; i < 3; i++) {
+    midi.setPan(CHANNELS[i], PANS[i]);
+  }
+}
+
+
+// ------------------------------------------------------------
+// loop()
+// Main loop that periodically chooses a random chord and plays it.
+// A new chord is played every 5000 ms (5 seconds).
+// ------------------------------------------------------------
+void loop() {
+  // Always call update() to let the MIDI library handle async tasks
+  midi.update();
+
+  // Check if we should play a new chord
+  if (millis() - lastTime >= 5000) {
+    lastTime = millis();
+
+    // -------------------------
+    // Step 1: Choose a random octave base
+    // These numbers are MIDI note numbers for C notes:
+    // C1 = 24, C2 = 36, C3 = 48, C4 = 60, C5 = 72
+    // Choose one randomly to vary pitch range.
+    // -------------------------
+    int octaves[] = {24, 36, 48, 60, 72};
+    int octaveBase = octaves[random(0, 5)]; // random index 0..4
+
+    // -------------------------
+    // Step 2: Choose a random white-key offset within the octave
+    // White keys in semitone offsets: 0 (C), 2 (D), 4 (E), 5 (F), 7 (G), 9 (A), 11 (B)
+    // This keeps melodies on "white keys" (no sharps/flats), which sounds musical.
+    // -------------------------
+    int offsets[] = {0, 2, 4, 5, 7, 9, 11};
+    int root = octaveBase + offsets[random(0, 7)];
+
+    // -------------------------
+    // Step 3: Choose a random General MIDI instrument (0..127)
+    // -------------------------
+    Instrument inst = (Instrument)random(0, 128);
+
+    // -------------------------
+    // Step 4: Play the chord for 1200 milliseconds (1.2 seconds)
+    // -------------------------
+    playChord((uint8_t)root, inst, 1200);
+
+    // Print a simple message to the Serial Monitor so user can see what played
+    Serial.println("========================================");
+    Serial.printf(" New chord:\n   Instrument: %d\n   Root note: %d\n", (int)inst, root);
+    Serial.println("========================================");
+  }
+}
@@ -0,0 +1,260 @@
+#pragma once
+
+/*
+  MIDI_Chords.h
+
+  Chord-symbol parser and voicing engine used by MIDI_VS1053.h.
+
+  Turns symbols such as "Dm7", "F#maj9", "Bb/D" or "Csus4" into MIDI note
+  numbers:
+    - the quality after the root is looked up in an interval table
+      (CHORD_QUALITIES), so adding a chord type is adding one line
+    - a slash bass ("C/G") is put below the voiced chord
+    - the notes are arranged by a Voicing; Voicing::Smooth picks the
+      inversion and octave closest to the previous chord (voice-leading)
+
+  It has no Arduino dependency, so it can be compiled and tested on a host.
+
+  Author: AdmDC
+  License: MIT
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#define CHORD_MAX_NOTES 6   // notes produced for one chord, slash bass included
+
+/*
+  How the chord tones are arranged.
+*/
+enum class Voicing : uint8_t {
+    Close,    // root position, tones stacked within an octave from the root
+    Drop2,    // close voicing with the second highest tone dropped an octave
+    Open,     // close voicing with every other tone raised an octave
+    Smooth    // the inversion nearest to the previous chord (least movement)
+};
+
+/*
+  ChordQuality: one line of the interval table, semitones above the root.
+*/
+struct ChordQuality {
+    const char *suffix;
+    uint8_t count;
+    uint8_t intervals[CHORD_MAX_NOTES];
+};
+
+static const ChordQuality CHORD_QUALITIES[] = {
+    { "",      3, {0, 4, 7} },
+    { "maj",   3, {0, 4, 7} },
+    { "m",     3, {0, 3, 7} },
+    { "min",   3, {0, 3, 7} },
+    { "-",     3, {0, 3, 7} },
+    { "dim",   3, {0, 3, 6} },
+    { "aug",   3, {0, 4, 8} },
+    { "+",     3, {0, 4, 8} },
+    { "sus2",  3, {0, 2, 7} },
+    { "sus4",  3, {0, 5, 7} },
+    { "sus",   3, {0, 5, 7} },
+    { "5",     2, {0, 7} },
+    { "6",     4, {0, 4, 7, 9} },
+    { "m6",    4, {0, 3, 7, 9} },
+    { "7",     4, {0, 4, 7, 10} },
+    { "maj7",  4, {0, 4, 7, 11} },
+    { "M7",    4, {0, 4, 7, 11} },
+    { "m7",    4, {0, 3, 7, 10} },
+    { "-7",    4, {0, 3, 7, 10} },
+    { "mMaj7", 4, {0, 3, 7, 11} },
+    { "m7b5",  4, {0, 3, 6, 10} },
+    { "dim7",  4, {0, 3, 6, 9} },
+    { "7sus4", 4, {0, 5, 7, 10} },
+    { "aug7",  4, {0, 4, 8, 10} },
+    { "7#5",   4, {0, 4, 8, 10} },
+    { "add9",  4, {0, 4, 7, 14} },
+    { "madd9", 4, {0, 3, 7, 14} },
+    { "9",     5, {0, 4, 7, 10, 14} },
+    { "maj9",  5, {0, 4, 7, 11, 14} },
+    { "m9",    5, {0, 3, 7, 10, 14} },
+    { "7b9",   5, {0, 4, 7, 10, 13} },
+    { "11",    6, {0, 4, 7, 10, 14, 17} },
+    { "m11",   6, {0, 3, 7, 10, 14, 17} },
+    { "13",    6, {0, 4, 7, 10, 14, 21} },
+};
+
+class ChordVoicer {
+public:
+    ChordVoicer() { reset(); }
+
+    // forget the previous chord (the next Smooth chord starts in close position)
+    void reset() { prevCount = 0; }
+
+    /*
+      voice(symbol, octave, voicing, out)
+      Writes the notes of symbol to out (lowest first, at most CHORD_MAX_NOTES)
+      and returns how many there are; 0 if the symbol is not understood.
+      octave places the root like note names do: "C4" = 60.
+      A slash bass is always played: when the chord already has
+      CHORD_MAX_NOTES tones (11, 13, ...) its fifth is left out to make room
+      (the highest tone if it has no perfect fifth). It goes right below the
+      chord; a chord too low for that (bass pitch under note 0) gets it in
+      the lowest octave, sorted in with the chord tones.
+    */
+    uint8_t voice(const char *symbol, int8_t octave, Voicing voicing, uint8_t out[CHORD_MAX_NOTES]) {
+        int8_t bass = -1;
+        uint8_t count = parse(symbol, octave, out, &bass);
+        if (count == 0) return 0;
+        if (bass >= 0 && count == CHORD_MAX_NOTES) {
+            uint8_t drop = count - 1;
+            for (uint8_t i = 1; i < count; i++) {
+                if (out[i] - out[0] == 7) { drop = i; break; }
+            }
+            memmove(out + drop, out + drop + 1, count - drop - 1);
+            count--;
+        }
+
+        switch (voicing) {
+            case Voicing::Drop2:
+                if (count >= 3) shift(out[count - 2], -12);
+                break;
+            case Voicing::Open:
+                for (uint8_t i = 1; i < count; i += 2) shift(out[i], 12);
+                break;
+            case Voicing::Smooth:
+                if (prevCount > 0) nearestInversion(out, count);
+                break;
+            default:
+                break;
+        }
+        sortNotes(out, count);
+
+        // remember the upper structure, then add the slash bass below it
+        memcpy(prev, out, count);
+        prevCount = count;
+        if (bass >= 0) {
+            // highest note of the bass pitch class below the chord
+            int16_t b = out[0] - 1 - ((out[0] - 1 - bass) % 12 + 12) % 12;
+            memmove(out + 1, out, count);
+            out[0] = (uint8_t)(b < 0 ? b + 12 : b);
+            count++;
+            if (b < 0) sortNotes(out, count);   // no room below the chord
+        }
+        return count;
+    }
+
+    /*
+      parse(symbol, octave, out, bassPitchClass)
+      Root position notes of symbol; the slash bass pitch class (0..11) is
+      returned through bassPitchClass (-1 when there is none).
+    */
+    static uint8_t parse(const char *symbol, int8_t octave, uint8_t out[CHORD_MAX_NOTES], int8_t *bassPitchClass = nullptr) {
+        if (symbol == nullptr) return 0;
+        const char *p = symbol;
+        int8_t root = pitchClass(p);
+        if (root < 0) return 0;
+
+        // quality: everything up to an optional "/bass"
+        const char *slash = strchr(p, '/');
+        size_t len = slash ? (size_t)(slash - p) : strlen(p);
+        const ChordQuality *q = nullptr;
+        for (size_t i = 0; i < sizeof(CHORD_QUALITIES) / sizeof(CHORD_QUALITIES[0]); i++) {
+            if (strlen(CHORD_QUALITIES[i].suffix) == len && strncmp(CHORD_QUALITIES[i].suffix, p, len) == 0) {
+                q = &CHORD_QUALITIES[i];
+                break;
+            }
+        }
+        if (q == nullptr) return 0;
+
+        if (bassPitchClass) {
+            *bassPitchClass = -1;
+            if (slash) {
+                const char *b = slash + 1;
+                *bassPitchClass = pitchClass(b);
+            }
+        }
+
+        int16_t base = 12 + octave * 12 + root;
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < q->count; i++) {
+            int16_t n = base + q->intervals[i];
+            if (n < 0 || n > 127) continue;
+            out[count++] = (uint8_t)n;
+        }
+        return count;
+    }
+
+private:
+    uint8_t prev[CHORD_MAX_NOTES];
+    uint8_t prevCount;
+
+    // reads "C", "F#", "Bb", "H" (= B) and moves p past it; -1 if not a note name
+    static int8_t pitchClass(const char *&p) {
+        static const int8_t letters[7] = {9, 11, 0, 2, 4, 5, 7};   // A..G
+        int8_t pc;
+        if (*p >= 'A' && *p <= 'G') pc = letters[*p - 'A'];
+        else if (*p == 'H') pc = 11;
+        else return -1;
+        p++;
+        if (*p == '#') { pc++; p++; }
+        else if (*p == 'b') { pc--; p++; }
+        return (int8_t)((pc + 12) % 12);
+    }
+
+    static void shift(uint8_t &note, int8_t semitones) {
+        int16_t n = note + semitones;
+        if (n >= 0 && n <= 127) note = (uint8_t)n;
+    }
+
+    static void sortNotes(uint8_t *notes, uint8_t count) {
+        for (uint8_t i = 1; i < count; i++) {
+            uint8_t v = notes[i];
+            uint8_t j = i;
+            while (j > 0 && notes[j - 1] > v) {
+                notes[j] = notes[j - 1];
+                j--;
+            }
+            notes[j] = v;
+        }
+    }
+
+    /*
+      nearestInversion(notes, count)
+      Tries every inversion of the close voicing, one octave either way, and
+      keeps the one whose notes are closest to the previous chord (sum of the
+      distances from each note to the nearest previous note and back).
+    */
+    void nearestInversion(uint8_t *notes, uint8_t count) {
+        uint8_t best[CHORD_MAX_NOTES];
+        uint32_t bestCost = UINT32_MAX;
+        uint8_t cand[CHORD_MAX_NOTES];
+        for (uint8_t inv = 0; inv < count; inv++) {
+            for (int8_t oct = -1; oct <= 1; oct++) {
+                bool valid = true;
+                for (uint8_t i = 0; i < count; i++) {
+                    int16_t n = notes[i] + oct * 12 + (i < inv ? 12 : 0);
+                    if (n < 0 || n > 127) { valid = false; break; }
+                    cand[i] = (uint8_t)n;
+                }
+                if (!valid) continue;
+                uint32_t cost = distance(cand, count, prev, prevCount) + distance(prev, prevCount, cand, count);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    memcpy(best, cand, count);
+                }
+            }
+        }
+        if (bestCost != UINT32_MAX) memcpy(notes, best, count);
+    }
+
+    // sum over a of the distance to the nearest note of b
+    static uint32_t distance(const uint8_t *a, uint8_t na, const uint8_t *b, uint8_t nb) {
+        uint32_t sum = 0;
+        for (uint8_t i = 0; i < na; i++) {
+            uint8_t d = 255;
+            for (uint8_t j = 0; j < nb; j++) {
+                uint8_t dj = a[i] > b[j] ? a[i] - b[j] : b[j] - a[i];
+                if (dj < d) d = dj;
+            }
+            sum += d;
+        }
+        return sum;
+    }
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+/*
+  MIDI_Parser.h
+
+  Byte-stream MIDI parser used by MIDI_VS1053.h.
+
+  Splits a raw MIDI byte stream into complete messages:
+    - channel messages, including running status (data bytes without a status)
+    - system common messages (MTC quarter frame, song position, song select, tune request)
+    - realtime bytes (clock, start, stop, ...) which may appear anywhere, even
+      in the middle of another message, without disturbing it
+    - SysEx (F0 ... F7), collected into a bounded buffer
+
+  It has no Arduino dependency, so it can be compiled and fed byte by byte
+  in a host test.
+
+  Author: AdmDC
+  License: MIT
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef MIDI_SYSEX_MAX
+#define MIDI_SYSEX_MAX 64   // SysEx payload bytes kept by the parser (longer messages are truncated)
+#endif
+
+static_assert(MIDI_SYSEX_MAX > 0 && MIDI_SYSEX_MAX <= 65535, "MIDI_SYSEX_MAX must fit the 16-bit SysEx length");
+
+/*
+  MidiMessage:
+    - status: status byte (0x80..0xFF), channel in the low nibble for channel messages
+    - data1, data2: data bytes (0 when the message has fewer)
+*/
+struct MidiMessage {
+    uint8_t status;
+    uint8_t data1;
+    uint8_t data2;
+};
+
+/*
+  Result of MidiParser::feed().
+*/
+enum class MidiParseResult : uint8_t {
+    None,      // byte consumed, nothing complete yet
+    Message,   // message() holds a complete channel, system common or realtime message
+    SysEx      // sysexData()/sysexLength() hold a complete SysEx payload (without F0/F7)
+};
+
+class MidiParser {
+public:
+    MidiParser() { reset(); }
+
+    // forget any partial message and the running status
+    void reset() {
+        runningStatus = 0;
+        pendingStatus = 0;
+        needed = 0;
+        count = 0;
+        inSysEx = false;
+        sysexLen = 0;
+        sysexOverflow = false;
+    }
+
+    /*
+      feed(byte)
+      Consumes one byte. Returns what (if anything) was completed by it.
+    */
+    MidiParseResult feed(uint8_t b) {
+        if (b >= 0xF8) {
+            // realtime: single byte, never changes the parser state
+            msg.status = b;
+            msg.data1 = 0;
+            msg.data2 = 0;
+            return MidiParseResult::Message;
+        }
+
+        if (b & 0x80) {
+            if (b == 0xF7) {
+                // end of SysEx
+                if (!inSysEx) return MidiParseResult::None;
+                inSysEx = false;
+                return MidiParseResult::SysEx;
+            }
+            // any other status byte aborts an unterminated SysEx
+            inSysEx = false;
+            if (b == 0xF0) {
+                inSysEx = true;
+                sysexLen = 0;
+                sysexOverflow = false;
+                runningStatus = 0;
+                return MidiParseResult::None;
+            }
+            // system common messages cancel running status
+            runningStatus = (b < 0xF0) ? b : 0;
+            pendingStatus = b;
+            needed = dataLength(b);
+            count = 0;
+            if (needed == 0) {
+                // Tune Request or undefined: complete on its own
+                msg.status = b;
+                msg.data1 = 0;
+                msg.data2 = 0;
+                pendingStatus = 0;
+                return (b == 0xF4 || b == 0xF5) ? MidiParseResult::None : MidiParseResult::Message;
+            }
+            return MidiParseResult::None;
+        }
+
+        // data byte
+        if (inSysEx) {
+            if (sysexLen < MIDI_SYSEX_MAX) sysex[sysexLen++] = b;
+            else sysexOverflow = true;
+            return MidiParseResult::None;
+        }
+        if (pendingStatus == 0) {
+            // running status: reuse the last channel status
+            if (runningStatus == 0) return MidiParseResult::None;   // stray data byte
+            pendingStatus = runningStatus;
+            needed = dataLength(runningStatus);
+            count = 0;
+        }
+        data[count++] = b;
+        if (count < needed) return MidiParseResult::None;
+
+        msg.status = pendingStatus;
+        msg.data1 = data[0];
+        msg.data2 = (needed > 1) ? data[1] : 0;
+        pendingStatus = 0;
+        count = 0;
+        return MidiParseResult::Message;
+    }
+
+    // the last complete message (valid after feed() returned Message)
+    const MidiMessage &message() const { return msg; }
+
+    // the last complete SysEx payload (valid after feed() returned SysEx);
+    // when sysexTruncated(), only its first MIDI_SYSEX_MAX bytes are kept
+    const uint8_t *sysexData() const { return sysex; }
+    uint16_t sysexLength() const { return sysexLen; }
+    bool sysexTruncated() const { return sysexOverflow; }
+
+    /*
+      dataLength(status)
+      Number of data bytes following a status byte (0 for single-byte messages).
+    */
+    static uint8_t dataLength(uint8_t status) {
+        switch (status & 0xF0) {
+            case 0xC0: case 0xD0: return 1;
+            case 0xF0:
+                if (status == 0xF1 || status == 0xF3) return 1;
+                if (status == 0xF2) return 2;
+                return 0;
+            default: return 2;
+        }
+    }
+
+private:
+    MidiMessage msg;
+    uint8_t runningStatus;   // last channel status (0 = none)
+    uint8_t pendingStatus;   // status of the message being collected (0 = none)
+    uint8_t needed;
+    uint8_t count;
+    uint8_t data[2];
+    bool inSysEx;
+    uint8_t sysex[MIDI_SYSEX_MAX];
+    uint16_t sysexLen;
+    bool sysexOverflow;
+};
@@ -18,7 +18,12 @@
 
 #include <Arduino.h>
 #include <SPI.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include "pins.h"
+#include "MIDI_Parser.h"
+#include "MIDI_Chords.h"
 
 ///////////////////// INSTRUMENTS (GM1, 0..127) /////////////////////
 /*
@@ -62,6 +67,22 @@ enum class Note : uint8_t {
     C8
 };
 
+///////////////////// PERCUSSION (GM channel 10, notes 35..81) /////////////////////
+/*
+  General MIDI percussion map. On the drum channel (DRUM_CHANNEL) the note
+  number selects the sound, so these values are used as notes.
+*/
+#define DRUM_CHANNEL 9   // GM channel 10, counted from 0
+
+enum class Drum : uint8_t {
+    AcousticBassDrum = 35, BassDrum1, SideStick, AcousticSnare, HandClap, ElectricSnare, LowFloorTom, ClosedHiHat,
+    HighFloorTom, PedalHiHat, LowTom, OpenHiHat, LowMidTom, HiMidTom, CrashCymbal1, HighTom,
+    RideCymbal1, ChineseCymbal, RideBell, Tambourine, SplashCymbal, Cowbell, CrashCymbal2, Vibraslap,
+    RideCymbal2, HiBongo, LowBongo, MuteHiConga, OpenHiConga, LowConga, HighTimbale, LowTimbale,
+    HighAgogo, LowAgogo, Cabasa, Maracas, ShortWhistle, LongWhistle, ShortGuiro, LongGuiro,
+    Claves, HiWoodBlock, LowWoodBlock, MuteCuica, OpenCuica, MuteTriangle, OpenTriangle
+};
+
 ///////////////////// VS1053 REAL-TIME MIDI PLUGIN /////////////////////
 /*
   Small plugin binary loaded to the VS1053 for realtime MIDI support.
@@ -75,41 +96,637 @@ static const uint16_t vs1053_plugin[] PROGMEM = {
 };
 
 ///////////////////// SEQUENCER CONFIG /////////////////////
+/*
+  Each size below can be overridden by defining it before including
+  MIDI_VS1053.h; values the fields below cannot hold stop the build.
+  Most of the RAM goes to the tracks
+  (SEQ_MAX_TRACKS x SEQ_MAX_EVENTS x 12 bytes) and to the song slots
+  (SEQ_SONG_SLOTS x SEQ_MAX_PATTERNS x SEQ_PATTERN_EVENTS x 12 bytes), see
+  the README.
+*/
+#ifndef SEQ_MAX_TRACKS
 #define SEQ_MAX_TRACKS      8
+#endif
+#ifndef SEQ_MAX_EVENTS
 #define SEQ_MAX_EVENTS      128   // per track
+#endif
+#ifndef SEQ_MAX_VOICES
 #define SEQ_MAX_VOICES      32    // concurrent active notes
+#endif
+#ifndef SEQ_TX_BUFFER
+#define SEQ_TX_BUFFER       64    // MIDI bytes collected before one SPI burst
+#endif
+#ifndef SEQ_MAX_SINKS
+#define SEQ_MAX_SINKS       2     // extra MIDI outputs (see addSink())
+#endif
+#ifndef SEQ_MAX_SCHEDULED
+#define SEQ_MAX_SCHEDULED   64    // pending timestamped events (noteOnAt(), playNoteAt(), ...)
+#endif
+#ifndef SEQ_ALERT_VOICES
+#define SEQ_ALERT_VOICES    4     // voice slots reserved for alerts (default)
+#endif
+#ifndef SEQ_ALERT_QUEUE
+#define SEQ_ALERT_QUEUE     4     // alerts requested from ISRs/other tasks, waiting for update()
+#endif
+#ifndef SEQ_MAX_LANES
+#define SEQ_MAX_LANES       8     // automation lanes (all tracks)
+#endif
+#ifndef SEQ_MAX_BREAKPOINTS
+#define SEQ_MAX_BREAKPOINTS 16    // per automation lane
+#endif
+#ifndef SEQ_GRID_STEPS
+#define SEQ_GRID_STEPS      32    // steps per grid track (see setGridTrack())
+#endif
+#ifndef SEQ_GRID_LANES
+#define SEQ_GRID_LANES      8     // lanes (notes) per grid track, one bit each
+#endif
+#ifndef SEQ_GROOVE_STEPS
+#define SEQ_GROOVE_STEPS    32    // steps per groove template (see extractGroove())
+#endif
+#ifndef SEQ_MAX_PATTERNS
+#define SEQ_MAX_PATTERNS    8     // patterns in the pattern pool (see addPatternNote())
+#endif
+#ifndef SEQ_PATTERN_EVENTS
+#define SEQ_PATTERN_EVENTS  64    // per pattern
+#endif
+#ifndef SEQ_ARRANGE_ENTRIES
+#define SEQ_ARRANGE_ENTRIES 16    // pattern placements per arranged track (see arrangePattern())
+#endif
+#ifndef SEQ_HELD_NOTES
+#define SEQ_HELD_NOTES      8     // explicit NoteOns an arranged track can leave open at a cut
+#endif
+#ifndef SEQ_MAX_SECTIONS
+#define SEQ_MAX_SECTIONS    8     // song sections (see setSection())
+#endif
+#ifndef SEQ_SONG_LENGTH
+#define SEQ_SONG_LENGTH     32    // sections in the song order (see setSongOrder())
+#endif
+#ifndef SEQ_SONG_SLOTS
+#define SEQ_SONG_SLOTS      2     // songs kept in memory (see loadSlot(), switchTo())
+#endif
+#ifndef SEQ_LOAD_TASK_STACK
+#define SEQ_LOAD_TASK_STACK 4096  // stack of the background song loader task
+#endif
+#ifndef SEQ_LOAD_TASK_PRIO
+#define SEQ_LOAD_TASK_PRIO  1     // its priority (lower than the loop task)
+#endif
+#ifndef ARP_MAX_NOTES
+#define ARP_MAX_NOTES       16    // notes the arpeggiator can hold
+#endif
+
+// limits of the fields that hold these counts and masks
+static_assert(SEQ_MAX_TRACKS > 0 && SEQ_MAX_TRACKS <= 32, "SEQ_MAX_TRACKS must fit the 32-bit track masks");
+static_assert(SEQ_MAX_VOICES > 0 && SEQ_MAX_VOICES <= 255, "SEQ_MAX_VOICES must fit the 8-bit voice counts");
+static_assert(SEQ_ALERT_VOICES <= SEQ_MAX_VOICES, "SEQ_ALERT_VOICES must not exceed SEQ_MAX_VOICES");
+static_assert(SEQ_TX_BUFFER > 0 && SEQ_TX_BUFFER <= 255, "SEQ_TX_BUFFER must fit the 8-bit tx length");
+static_assert(SEQ_MAX_SCHEDULED > 0 && SEQ_MAX_SCHEDULED <= 255, "SEQ_MAX_SCHEDULED must fit the 8-bit scheduled count");
+static_assert(SEQ_MAX_BREAKPOINTS <= 255, "SEQ_MAX_BREAKPOINTS must fit the 8-bit point count");
+static_assert(SEQ_GRID_STEPS > 0 && SEQ_GRID_STEPS <= 32, "SEQ_GRID_STEPS must fit the 32-bit step masks");
+static_assert(SEQ_GRID_LANES > 0 && SEQ_GRID_LANES <= 8, "SEQ_GRID_LANES must fit the 8-bit lane masks");
+static_assert(SEQ_MAX_PATTERNS < 0xFF, "SEQ_MAX_PATTERNS must stay below SEQ_NO_PATTERN");
+static_assert(SEQ_ARRANGE_ENTRIES <= 255, "SEQ_ARRANGE_ENTRIES must fit the 8-bit entry count");
+static_assert(SEQ_HELD_NOTES <= 255, "SEQ_HELD_NOTES must fit the 8-bit held count");
+static_assert(SEQ_SONG_LENGTH <= 255, "SEQ_SONG_LENGTH must fit the 8-bit order count");
+static_assert(SEQ_MAX_SECTIONS < 0xFF, "SEQ_MAX_SECTIONS must stay below SEQ_NO_SECTION");
+static_assert(ARP_MAX_NOTES <= 255, "ARP_MAX_NOTES must fit the 8-bit held count");
+
+#define SEQ_NO_TRACK        0xFF  // voice owner for ad-hoc (non-sequencer) notes
+#define SEQ_ALERT_TRACK     0xFE  // voice owner for alert notes (see playAlert())
+#define SEQ_NO_PATTERN      0xFF  // section track without a pattern (silent)
+#define SEQ_NO_SECTION      0xFF  // no section playing / queued
+#define SEQ_NO_SLOT         0xFF  // no song switch pending
+#define SEQ_DEFAULT_BPM     120   // reference tempo of event times (see setSongTempo())
 
 /*
-  SeqEvent:
+  Kind of a sequencer event. Stored in 4 bits of SeqEvent.
+*/
+enum class SeqEventType : uint8_t {
+    Note = 0,          // note with instrument, velocity and duration
+    ControlChange,     // CC controller/value
+    PitchBend,         // 14-bit bend, 8192 = center
+    ChannelPressure,   // channel aftertouch
+    ProgramChange,     // instrument change without a note
+    Tempo,             // playback tempo change (channel unused)
+    NoteOn,            // bare Note On (no automatic Note Off)
+    NoteOff            // bare Note Off
+};
+
+/*
+  SeqEvent (12 bytes):
     - timeOffsetMs: when the event should fire relative to track start (ms)
     - channel: MIDI channel (0..15)
-    - inst: instrument (Program Change)
-    - note: Note to play
-    - velocity: Note velocity (0..127)
-    - durationMs: how long the note should play (ms)
-    - played: internal flag used by sequencer to avoid double triggering within a loop
+    - type: SeqEventType (use kind() to read it)
+    - payload, depending on type:
+        Note:            inst, note, velocity, durationMs (how long the note plays)
+        NoteOn/NoteOff:  note, velocity
+        ControlChange:   controller, value
+        PitchBend:       bendLsb, bendMsb (7 bits each)
+        ChannelPressure: pressure
+        ProgramChange:   program
+        Tempo:           tempoCentiBpm (BPM * 100)
+  Events are kept sorted by timeOffsetMs inside each track, so the sequencer
+  only has to look at the next pending event of every track (see update()).
 */
 struct SeqEvent {
     uint32_t timeOffsetMs;
-    uint8_t channel;
-    Instrument inst;
-    Note note;
-    uint8_t velocity;
-    uint32_t durationMs;
-    bool played;
+    uint8_t channel : 4;
+    uint8_t type : 4;
+    union {
+        struct { Instrument inst; Note note; uint8_t velocity; };
+        struct { uint8_t controller; uint8_t value; };
+        struct { uint8_t bendLsb; uint8_t bendMsb; };
+        uint8_t pressure;
+        Instrument program;
+    };
+    union {
+        uint32_t durationMs;
+        uint32_t tempoCentiBpm;
+    };
+
+    SeqEventType kind() const { return (SeqEventType)type; }
 };
 
 /*
   ActiveVoice:
     - used to remember scheduled noteOff times and to free voice slots
+    - track: sequencer track that started the note, SEQ_NO_TRACK for ad-hoc notes,
+      SEQ_ALERT_TRACK for alerts
 */
 struct ActiveVoice {
     bool active;
     uint8_t channel;
     uint8_t note;
+    uint8_t track;
     uint32_t offTimeMs;
 };
 
+/*
+  Called once when a one-shot playback has finished: the last event was played
+  and its note was released. Runs from inside update().
+*/
+typedef void (*SongEndCallback)();
+
+/*
+  Scheduler hooks. Plain function pointers, called synchronously from update()
+  (no heap, no std::function); keep them short, they run in the timing path.
+    - EventFiredCallback: a sequencer event was just sent
+    - LoopWrapCallback: the pattern wrapped; cycle counts completed passes
+    - VoiceStolenCallback: a sounding note was cut to free a voice slot
+    - LateCallback: an event was sent lateMs after its scheduled time
+      (only when lateMs exceeds the threshold set with setLateThreshold())
+*/
+typedef void (*EventFiredCallback)(uint8_t track, const SeqEvent &ev);
+typedef void (*LoopWrapCallback)(uint32_t cycle);
+typedef void (*VoiceStolenCallback)(uint8_t channel, uint8_t note, uint8_t track);
+typedef void (*LateCallback)(uint8_t track, const SeqEvent &ev, uint32_t lateMs);
+
+/*
+  Called when a song section starts (see startSong()); section is
+  SEQ_NO_SECTION when the song order has run out.
+*/
+typedef void (*SectionChangeCallback)(uint8_t section, uint32_t startMs);
+
+///////////////////// AUTOMATION /////////////////////
+#define AUTOMATION_PITCH_BEND 0xFF  // lane target: pitch bend instead of a CC number
+
+/*
+  Shape of an automation segment, from one breakpoint to the next.
+  Exponential/Logarithmic are quadratic approximations (slow start / slow end),
+  which is what filter and volume sweeps usually want.
+*/
+enum class Curve : uint8_t {
+    Step,         // hold the value until the next breakpoint
+    Linear,
+    Exponential,  // slow start, fast end
+    Logarithmic   // fast start, slow end
+};
+
+/*
+  AutomationPoint: value at timeOffsetMs (track time) and the curve used to
+  reach the next point. value is 0..127 for CCs, -8192..8191 for pitch bend.
+*/
+struct AutomationPoint {
+    uint32_t timeOffsetMs;
+    int16_t value;
+    Curve curve;
+};
+
+/*
+  AutomationLane: breakpoints for one CC (or pitch bend) on one channel,
+  bound to a sequencer track. The value is interpolated while playing and is
+  only sent when it changed and at most every minIntervalMs, so long sweeps
+  cost a bounded number of MIDI messages.
+*/
+struct AutomationLane {
+    bool used;
+    uint8_t track;
+    uint8_t channel;
+    uint8_t target;          // CC number or AUTOMATION_PITCH_BEND
+    uint8_t pointCount;
+    uint8_t segment;         // playback cursor: current breakpoint
+    uint16_t minIntervalMs;
+    int16_t lastValue;       // last value sent (LANE_NO_VALUE = none yet)
+    uint32_t lastSentMs;
+    AutomationPoint points[SEQ_MAX_BREAKPOINTS];
+};
+
+#define LANE_NO_VALUE INT16_MIN
+
+/*
+  GridTrack: step-sequencer storage for drum and ostinato patterns.
+  Each step is one byte, bit l set = lane l plays on that step, so a 16 step,
+  8 lane pattern is 16 bytes instead of one SeqEvent per hit. Each lane has
+  its note and velocity; steps in accentSteps use accentVelocity instead.
+  The grid is kept in the track's own event storage (see TrackStore).
+*/
+struct GridTrack {
+    uint8_t steps;
+    uint8_t channel;
+    Instrument inst;
+    uint32_t stepMs;
+    uint32_t gateMs;                         // note length
+    uint8_t laneNote[SEQ_GRID_LANES];
+    uint8_t laneVelocity[SEQ_GRID_LANES];
+    uint8_t stepLanes[SEQ_GRID_STEPS];      // bit l = lane l hits on this step
+    uint32_t accentSteps;                    // bit s = step s is accented
+    uint8_t accentVelocity;
+};
+
+/*
+  GeneratorTrack: a rhythm computed step by step while playing instead of
+  being stored as events (see setGeneratorTrack()). A step is hit when it is
+  one of the Euclidean pulses (k hits spread as evenly as possible over n
+  steps, rotated), then passes the probability check; a hit may be
+  ratcheted (repeated within its step). The random numbers come from a
+  xorshift32 generator restarted from seed by startSequencer(), so a
+  playback is repeatable while the loops never repeat exactly.
+*/
+struct GeneratorTrack {
+    uint8_t steps;            // n
+    uint8_t pulses;           // k (k == n: every step)
+    uint8_t rotation;
+    uint8_t probability;      // % chance a pulse is played
+    uint8_t ratchetChance;    // % chance a played hit is ratcheted
+    uint8_t ratchetCount;     // hits per ratcheted step
+    uint8_t channel;
+    Instrument inst;
+    uint8_t note;
+    uint8_t velocity;
+    uint32_t stepMs;
+    uint32_t gateMs;
+    uint32_t seed;
+    uint32_t rng;             // xorshift32 state
+};
+
+/*
+  Groove: timing and velocity feel of one loop, per grid step (see
+  extractGroove()). timingMs is how far the notes on a step were played
+  from the grid, velocity how much louder or softer than the average.
+  68 bytes for 32 steps.
+*/
+struct Groove {
+    uint8_t steps;
+    uint16_t gridMs;
+    int8_t timingMs[SEQ_GROOVE_STEPS];
+    int8_t velocity[SEQ_GROOVE_STEPS];
+};
+
+/*
+  Pattern: events shared by the arranged tracks (see arrangePattern()),
+  sorted by time like a track. Repeats of a pattern are played from here,
+  never copied.
+*/
+struct Pattern {
+    uint16_t eventCount;
+    bool fixedLength;         // lengthMs was given: notes may ring into the next repeat
+    uint32_t lengthMs;        // one repeat (not fixed: up to the end of the last note)
+    SeqEvent events[SEQ_PATTERN_EVENTS];
+};
+
+/*
+  ArrangeEntry: one placement of a pattern on an arranged track, 8 bytes.
+*/
+struct ArrangeEntry {
+    uint32_t startMs;
+    uint16_t repeat;          // how many times the pattern is played back to back
+    uint8_t pattern;
+    int8_t transpose;         // semitones added to the notes (not on drum tracks)
+};
+
+/*
+  Arrangement: the placements of one arranged track, sorted by startMs, and
+  the play position: entry, repeat inside it, and (in trackCursor) the event
+  of the pattern. Events at or after endMs are not played (song sections
+  cut the last repeat there).
+*/
+struct Arrangement {
+    uint8_t entryCount;
+    uint8_t entry;
+    uint16_t repeat;
+    uint32_t endMs;
+    ArrangeEntry entries[SEQ_ARRANGE_ENTRIES];
+};
+
+/*
+  What a track plays (see TrackStore).
+*/
+enum class TrackMode : uint8_t {
+    Events,        // the SeqEvent list (addEvent(), recording, ...)
+    Grid,          // setGridTrack()
+    Generator,     // setGeneratorTrack()
+    Arranged       // arrangePattern(), song sections
+};
+
+/*
+  TrackStore: storage of one track. A grid, generator or arranged track no
+  longer has events, so it lives in the space of its event list and adds no
+  RAM.
+*/
+union TrackStore {
+    SeqEvent events[SEQ_MAX_EVENTS];
+    GridTrack grid;
+    GeneratorTrack generator;
+    Arrangement arrangement;
+};
+
+/*
+  Section: one part of a song (intro, verse, chorus, ...): the pattern each
+  track plays, repeated for lengthMs, 20 bytes.
+*/
+struct Section {
+    uint32_t lengthMs;        // 0 = section not defined
+    uint8_t pattern[SEQ_MAX_TRACKS];     // SEQ_NO_PATTERN = track silent
+    int8_t transpose[SEQ_MAX_TRACKS];
+};
+
+/*
+  SongSlot: the pattern pool, sections and song order of one song slot (see
+  loadSlot()). The sequencer plays one slot while others are loaded.
+*/
+struct SongSlot {
+    Pattern patterns[SEQ_MAX_PATTERNS];
+    Section sections[SEQ_MAX_SECTIONS];
+    uint8_t order[SEQ_SONG_LENGTH];
+    uint8_t orderCount;
+    bool loop;
+};
+
+class VS1053_MIDI;
+
+/*
+  Fills a song slot from the background loader task (see loadSlot()). It
+  builds the song with the usual pattern and section calls (addPatternNote(),
+  setSection(), setSongOrder(), ...), which write to the loading slot when
+  called from that task. The track calls (addEvent(), storePattern(),
+  clearTrack(), ...) refuse to run there: the tracks are being played.
+*/
+typedef void (*SongLoader)(VS1053_MIDI &midi, void *arg);
+
+/*
+  ScheduledEvent: an event waiting in the deadline queue for its absolute
+  micros() timestamp. track is SEQ_NO_TRACK for events from the *At() API.
+*/
+struct ScheduledEvent {
+    SeqEvent ev;
+    uint32_t dueUs;
+    uint8_t track;
+};
+
+///////////////////// FADES /////////////////////
+#define FADE_MASTER 0x10  // fadeTo() channel for the global output volume (SCI_VOL)
+
+/*
+  AlertRequest: an alert note queued by requestAlert() (ISR / other task)
+  until update() plays it.
+*/
+struct AlertRequest {
+    uint8_t channel;
+    Instrument inst;
+    Note note;
+    uint8_t velocity;
+    uint32_t durationMs;
+};
+
+/*
+  Fade: a volume ramp run by update(). Channel fades ramp CC#7, the master
+  fade ramps the VS1053 SCI_VOL register in 0.5 dB steps.
+*/
+struct Fade {
+    bool active;
+    Curve curve;
+    uint8_t from;
+    uint8_t to;
+    uint32_t startMs;
+    uint32_t durationMs;
+};
+
+///////////////////// MIDI OUTPUT SINKS /////////////////////
+/*
+  MidiSink: an extra destination for the MIDI stream the engine produces
+  (in addition to, or instead of, the VS1053). The engine calls write() with
+  one complete message at a time, status byte always included (1..3 bytes, or
+  a whole F0..F7 SysEx), so every sink can buffer, pace, drop and apply
+  running status on its own terms. write() must never block.
+    - writeRealtime(): one realtime byte (clock, Start, Stop, ...) from
+      setClockOutput(). It is called from the esp_timer task, concurrently
+      with the other calls; the default forwards to write(), so a sink used
+      as clock output must either override it thread-safely (UartMidiSink
+      does) or make write() safe to call from two tasks
+    - writeSysEx(): a SysEx of any length, payload without F0/F7. The
+      default passes the framed message to write() in pieces of up to
+      MIDI_SINK_SYSEX_CHUNK bytes; override it to keep a long SysEx whole
+    - flush(): end of a burst, a good moment to start transmitting
+    - poll(): called from every VS1053_MIDI::update() to keep output moving
+*/
+#define MIDI_SINK_SYSEX_CHUNK 32
+
+class MidiSink {
+public:
+    virtual ~MidiSink() {}
+    virtual void write(const uint8_t *msg, size_t len) = 0;
+
+    virtual void writeRealtime(uint8_t b) { write(&b, 1); }
+
+    virtual void writeSysEx(const uint8_t *data, size_t len) {
+        uint8_t chunk[MIDI_SINK_SYSEX_CHUNK];
+        size_t n = 0;
+        chunk[n++] = 0xF0;
+        for (size_t i = 0; i < len; i++) {
+            chunk[n++] = data[i] & 0x7F;
+            if (n == MIDI_SINK_SYSEX_CHUNK) { write(chunk, n); n = 0; }
+        }
+        chunk[n++] = 0xF7;
+        write(chunk, n);
+    }
+
+    virtual void flush() {}
+    virtual void poll() {}
+};
+
+#define MIDI_UART_SINK_QUEUE 256   // bytes queued by UartMidiSink
+
+/*
+  What UartMidiSink does with a message that does not fit in its queue.
+*/
+enum class SinkDropPolicy : uint8_t {
+    DropNewest,   // discard the new message (what is queued stays intact)
+    DropOldest    // discard the oldest queued messages until it fits
+};
+
+/*
+  UartMidiSink: MIDI-OUT on a UART at 31250 baud.
+  A UART moves ~3 bytes per ms, far slower than SPI, so messages are queued
+  here and poll() only hands the UART driver as many bytes as it has room
+  for. When the queue is full the drop policy applies; the VS1053 output is
+  never held up. Messages are queued with their status bytes and running
+  status is applied while transmitting; after a drop the next message is
+  sent with its status byte, so a message cut mid-way is discarded by the
+  receiver and never misaligns the bytes that follow.
+  Realtime bytes (clock, start, stop) skip the queue to keep their timing.
+*/
+class UartMidiSink : public MidiSink {
+public:
+    UartMidiSink(HardwareSerial &p, SinkDropPolicy policy = SinkDropPolicy::DropNewest)
+        : port(p), dropPolicy(policy), head(0), tail(0), count(0), lastStatus(0), droppedCount(0), droppedRealtime(0) {}
+
+    // opens the UART at the MIDI baud rate (31250, 8N1)
+    void begin(int8_t txPin, int8_t rxPin = -1) {
+        port.begin(31250, SERIAL_8N1, rxPin, txPin);
+        lastStatus = 0;
+    }
+
+    void write(const uint8_t *msg, size_t len) override {
+        if (len == 0) return;
+        if (len == 1 && msg[0] >= 0xF8) {
+            writeRealtime(msg[0]);
+            return;
+        }
+        if (len > MIDI_UART_SINK_QUEUE) { droppedCount++; return; }
+        if (MIDI_UART_SINK_QUEUE - count < len) {
+            if (dropPolicy == SinkDropPolicy::DropNewest) { droppedCount++; return; }
+            while (MIDI_UART_SINK_QUEUE - count < len) dropOldest();
+        }
+        for (size_t i = 0; i < len; i++) enqueue(msg[i]);
+    }
+
+    // realtime: may be inserted anywhere in the stream, so it skips the queue
+    // and goes straight to the UART driver (which is safe to call from the
+    // clock timer task while poll() runs in the loop task)
+    void writeRealtime(uint8_t b) override {
+        if (port.availableForWrite() > 0) port.write(b);
+        else droppedRealtime++;
+    }
+
+    // queued whole (F0 <data> F7) or dropped whole, never cut; a SysEx
+    // longer than the queue (MIDI_UART_SINK_QUEUE - 2 bytes) is dropped
+    void writeSysEx(const uint8_t *data, size_t len) override {
+        size_t total = len + 2;
+        if (total > MIDI_UART_SINK_QUEUE) { droppedCount++; return; }
+        if (MIDI_UART_SINK_QUEUE - count < total) {
+            if (dropPolicy == SinkDropPolicy::DropNewest) { droppedCount++; return; }
+            while (MIDI_UART_SINK_QUEUE - count < total) dropOldest();
+        }
+        enqueue(0xF0);
+        for (size_t i = 0; i < len; i++) enqueue(data[i] & 0x7F);
+        enqueue(0xF7);
+    }
+
+    void flush() override { poll(); }
+
+    void poll() override {
+        int room = port.availableForWrite();
+        while (count > 0 && room > 0) {
+            uint8_t b = queue[tail];
+            tail = (tail + 1) % MIDI_UART_SINK_QUEUE;
+            count--;
+            if (b >= 0x80 && b < 0xF0) {
+                if (b == lastStatus) continue;   // running status
+                lastStatus = b;
+            } else if (b >= 0xF0) {
+                lastStatus = 0;                  // system messages cancel running status
+            }
+            port.write(b);
+            room--;
+        }
+    }
+
+    // messages discarded because the queue (or, for realtime bytes, the UART) was full
+    uint32_t dropped() const { return droppedCount + droppedRealtime; }
+
+    // bytes waiting for the UART
+    size_t pending() const { return count; }
+
+private:
+    HardwareSerial &port;
+    SinkDropPolicy dropPolicy;
+    uint8_t queue[MIDI_UART_SINK_QUEUE];
+    size_t head;
+    size_t tail;
+    size_t count;
+    uint8_t lastStatus;        // running status on the wire
+    uint32_t droppedCount;
+    volatile uint32_t droppedRealtime;   // counted by writeRealtime() (clock task)
+
+    void enqueue(uint8_t b) {
+        queue[head] = b;
+        head = (head + 1) % MIDI_UART_SINK_QUEUE;
+        count++;
+    }
+
+    /*
+      Removes the oldest queued message (status byte up to the next status
+      byte). poll() may have sent the start of it already, so running status
+      is reset: the next message goes out with its status byte, which ends
+      the cut message on the receiver (an incomplete message is discarded)
+      instead of lending it its data bytes.
+    */
+    void dropOldest() {
+        do {
+            tail = (tail + 1) % MIDI_UART_SINK_QUEUE;
+            count--;
+        } while (count > 0 && (queue[tail] < 0x80 || queue[tail] == 0xF7));
+        lastStatus = 0;
+        droppedCount++;
+    }
+};
+
+/*
+  Scales for setTrackScale(): bit n set = pitch class n semitones above the
+  root belongs to the scale.
+*/
+enum class Scale : uint16_t {
+    Chromatic       = 0xFFF,
+    Major           = 0xAB5,   // 0 2 4 5 7 9 11
+    Minor           = 0x5AD,   // 0 2 3 5 7 8 10
+    HarmonicMinor   = 0x9AD,   // 0 2 3 5 7 8 11
+    Dorian          = 0x6AD,   // 0 2 3 5 7 9 10
+    Phrygian        = 0x5AB,   // 0 1 3 5 7 8 10
+    Lydian          = 0xAD5,   // 0 2 4 6 7 9 11
+    Mixolydian      = 0x6B5,   // 0 2 4 5 7 9 10
+    PentatonicMajor = 0x295,   // 0 2 4 7 9
+    PentatonicMinor = 0x4A9,   // 0 3 5 7 10
+    Blues           = 0x4E9    // 0 3 5 6 7 10
+};
+
+/*
+  Order in which the arpeggiator plays the held notes (see arpEnable()).
+*/
+enum class ArpMode : uint8_t {
+    Up,         // lowest to highest, then the next octave
+    Down,       // highest to lowest
+    UpDown,     // up then down, the top and bottom notes played once
+    Random,
+    AsPlayed    // in the order the keys were pressed
+};
+
+/*
+  Where the sequencer takes its tempo and position from (see setClockSource()).
+*/
+enum class ClockSource : uint8_t {
+    Internal,   // setTempo() and micros()
+    External    // MIDI clock received through receiveClock() (e.g. from MidiInput)
+};
+
 class VS1053_MIDI {
 public:
     VS1053_MIDI() {
@@ -117,15 +734,121 @@ public:
         for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
             trackEventCount[t] = 0;
             trackLoopLengthMs[t] = 0;
+            trackCursor[t] = 0;
+            trackMode[t] = TrackMode::Events;
+            heldCount[t] = 0;
+            heldSustain[t] = 0;
+            heldOverflow[t] = 0;
+            trackTranspose[t] = 0;
+            trackScaleMask[t] = (uint16_t)Scale::Chromatic;
+            trackScaleRoot[t] = 0;
+            trackSwing[t] = 50;
+            trackSwingGridMs[t] = 0;
+            trackHumanizeMs[t] = 0;
+            trackHumanizeVel[t] = 0;
+            trackHumanizeRng[t] = 0x9E3779B9u + t;
+            trackGroove[t] = nullptr;
+            trackGrooveAmount[t] = 0;
+            trackGrooveEarlyMs[t] = 0;
+        }
+        for (int slot = 0; slot < SEQ_SONG_SLOTS; slot++) {
+            clearSong(songs[slot]);
+            slotLoading[slot] = false;
         }
+        song = &songs[0];
+        editSong = &songs[0];
+        loaderTask = nullptr;
+        pendingSlot = SEQ_NO_SLOT;
+        songPlaying = false;
+        songTrackMask = 0;
+        songIndex = 0;
+        songSection = SEQ_NO_SECTION;
+        queuedSection = SEQ_NO_SECTION;
+        songSectionStartMs = 0;
+        songSectionEndMs = 0;
+        noteMapMask = 0;
+        feelMask = 0;
+        drumTrackMask = 0;
+        drumReleaseMs = 30;
         for (int v = 0; v < SEQ_MAX_VOICES; v++) {
             voices[v].active = false;
         }
+        for (int l = 0; l < SEQ_MAX_LANES; l++) lanes[l].used = false;
+        for (int f = 0; f <= FADE_MASTER; f++) fades[f].active = false;
+        activeFadeCount = 0;
+        for (int c = 0; c < 16; c++) channelVolume[c] = 100;   // GM power-on default
+        outputAttenuation = 0;
+        alertChannelMask = 1 << 15;
+        alertReservedVoices = SEQ_ALERT_VOICES;
+        alertVoiceCount = 0;
+        alertHead = 0;
+        alertTail = 0;
+        duckLevel = 40;
+        duckAttackMs = 20;
+        duckReleaseMs = 400;
+        duckedMask = 0;
+        usedChannelMask = 0;
+        activeVoiceCount = 0;
+        nextVoiceOffMs = 0;
+        scheduledCount = 0;
         // initialize last-instrument array to invalid value (255)
         for (int c = 0; c < 16; c++) lastChannelInstrument[c] = 255;
+        txLen = 0;
+        txBatchDepth = 0;
+        runningStatus = 0;
+        vs1053Output = true;
+        sinkCount = 0;
+        clockSink = nullptr;
+        clockTimer = nullptr;
+        clockRunning = false;
+        clockNextUs = 0;
+        clockFrac = 0;
+        recordTrack = SEQ_NO_TRACK;
+        recordChannel = 0;
+        recordInstrument = Instrument::AcousticGrandPiano;
+        recordQuantizeMs = 0;
+        for (int n = 0; n < 128; n++) recordVelocity[n] = 0;
+        arpEnabled = false;
+        arpChannel = 0;
+        arpInstrument = Instrument::AcousticGrandPiano;
+        arpMode = ArpMode::Up;
+        arpOctaves = 1;
+        arpStepsPerBeat = 4;
+        arpGatePercent = 50;
+        arpHeldCount = 0;
+        arpStep = 0;
+        arpNextUs = 0;
+        arpNextFrac = 0;
+        arpRng = 0x2545F491;
+        clockSource = ClockSource::Internal;
+        clockLockMs = 500;
+        clockDriftMs = 250;
+        extPeriodQ8 = 0;
+        extLastPulseUs = 0;
+        extPredictUs = 0;
+        extPredictFrac = 0;
+        extPulses = 0;
+        extPulseCount = 0;
+        extLocked = false;
+        extTransport = 0;
 
         sequencerRunning = false;
+        sequencerLooping = true;
+        sequencerCycle = 0;
+        sequencerPosUs = 0;
+        sequencerPosFrac = 0;
+        lastPositionUs = 0;
+        songTempoCentiBpm = SEQ_DEFAULT_BPM * 100;
+        tempoCentiBpm = SEQ_DEFAULT_BPM * 100;
+        tempoRateQ16 = 0x10000;
         globalLoopMs = 0;
+        songEndCallback = nullptr;
+        eventFiredCallback = nullptr;
+        loopWrapCallback = nullptr;
+        voiceStolenCallback = nullptr;
+        lateCallback = nullptr;
+        sectionChangeCallback = nullptr;
+        lateThresholdMs = 2;
         debug = false;
     }
 
@@ -160,7 +883,9 @@ public:
         SPI.setFrequency(1000000);
 
         loadPlugin();
+        runningStatus = 0;   // fresh MIDI parser on the chip
         writeRegister(0x0B, 0x00, 0x00); // volume max (initial)
+        outputAttenuation = 0;
 
         if (debug) Serial.println("[MIDI] Hardware initialized");
     }
@@ -193,6 +918,7 @@ public:
     */
     void noteOn(uint8_t channel, Note note, uint8_t vel = 100) {
         talkMIDI(0x90 | (channel & 0x0F), (uint8_t)note, vel);
+        usedChannelMask |= 1 << (channel & 0x0F);
         if (debug) Serial.printf("[MIDI] noteOn ch=%d note=%d vel=%d\n", channel, (uint8_t)note, vel);
     }
 
@@ -205,6 +931,34 @@ public:
         if (debug) Serial.printf("[MIDI] noteOff ch=%d note=%d\n", channel, (uint8_t)note);
     }
 
+    /*
+      controlChange(channel, controller, value)
+      Send a Control Change message (0xB0). controller and value: 0..127
+    */
+    void controlChange(uint8_t channel, uint8_t controller, uint8_t value) {
+        sendControl(channel & 0x0F, controller & 0x7F, value & 0x7F);
+        if (debug) Serial.printf("[MIDI] CC ch=%d cc=%d val=%d\n", channel, controller, value);
+    }
+
+    /*
+      pitchBend(channel, bend)
+      Send a Pitch Bend message (0xE0). bend: -8192..8191, 0 = center.
+    */
+    void pitchBend(uint8_t channel, int16_t bend) {
+        uint16_t v = bendToRaw(bend);
+        talkMIDI(0xE0 | (channel & 0x0F), v & 0x7F, (v >> 7) & 0x7F);
+        if (debug) Serial.printf("[MIDI] pitchBend ch=%d bend=%d\n", channel, bend);
+    }
+
+    /*
+      channelPressure(channel, pressure)
+      Send a Channel Pressure (aftertouch) message (0xD0). pressure: 0..127
+    */
+    void channelPressure(uint8_t channel, uint8_t pressure) {
+        talkMIDI(0xD0 | (channel & 0x0F), pressure & 0x7F);
+        if (debug) Serial.printf("[MIDI] channelPressure ch=%d p=%d\n", channel, pressure);
+    }
+
     /*
       playNoteAsync(channel, inst, note, durationMs, vel)
       Convenience method to play a note immediately and schedule its noteOff.
@@ -214,301 +968,3483 @@ public:
     */
     void playNoteAsync(uint8_t channel, Instrument inst, Note note, uint32_t durationMs, uint8_t vel = 110) {
         setInstrument(channel, inst);                           // will only send PC if changed
+        int slot = claimVoice(SEQ_NO_TRACK);
         noteOn(channel, note, vel);
-        scheduleVoiceOff(channel, (uint8_t)note, millis() + durationMs);
+        occupyVoice(slot, channel, (uint8_t)note, millis() + durationMs, SEQ_NO_TRACK);
         if (debug) Serial.printf("[MIDI] playNoteAsync ch=%d inst=%d note=%d dur=%d\n", channel, (uint8_t)inst, (uint8_t)note, durationMs);
     }
 
     /*
-      Alternative overload: playNoteAsync(channel, note, durationMs, vel)
-      If you already set instrument on that channel separately, you can use
-      this overload to avoid passing the instrument again.
+      Alternative overload: playNoteAsync(channel, note, durationMs, vel)
+      If you already set instrument on that channel separately, you can use
+      this overload to avoid passing the instrument again.
+    */
+    void playNoteAsync(uint8_t channel, Note note, uint32_t durationMs, uint8_t vel = 110) {
+        int slot = claimVoice(SEQ_NO_TRACK);
+        noteOn(channel, note, vel);
+        occupyVoice(slot, channel, (uint8_t)note, millis() + durationMs, SEQ_NO_TRACK);
+        if (debug) Serial.printf("[MIDI] playNoteAsync ch=%d note=%d dur=%d\n", channel, (uint8_t)note, durationMs);
+    }
+
+    /*
+      playChordAsync(channel, inst, notes, count, durationMs, vel, strumMs)
+      Plays a whole chord on one channel. With strumMs == 0 all Note Ons are
+      encoded with running status (0x9n n1 v n2 v ...) and sent in a single SPI
+      burst; all Note Offs are registered in one pass over the voice table.
+      With strumMs > 0 note i starts i * strumMs later (queued as a whole note,
+      see playNoteAt()); every note lasts durationMs from its own start.
+      Returns how many notes were played or queued (a strummed note is
+      dropped when the timestamp queue is full).
+    */
+    uint8_t playChordAsync(uint8_t channel, Instrument inst, const Note notes[], uint8_t count, uint32_t durationMs,
+                           uint8_t vel = 110, uint32_t strumMs = 0) {
+        if (count == 0) return 0;
+        uint8_t ch = channel & 0x0F;
+        uint8_t noteVals[SEQ_MAX_VOICES];
+        if (count > SEQ_MAX_VOICES) count = SEQ_MAX_VOICES;
+        uint8_t nowCount = strumMs == 0 ? count : 1;   // notes that start right away
+        uint32_t nowUs = micros();
+        beginBatch();
+        setInstrument(ch, inst);
+        // voices first: a stolen voice's Note Off must not follow the new Note On
+        for (uint8_t i = 0; i < nowCount; i++) noteVals[i] = (uint8_t)notes[i];
+        uint8_t voiced = scheduleVoiceOffs(ch, noteVals, nowCount, millis() + durationMs, SEQ_NO_TRACK);
+        for (uint8_t i = 0; i < voiced; i++) noteOn(ch, notes[i], vel);
+        uint8_t played = voiced;
+        for (uint8_t i = nowCount; i < count; i++) {
+            // the voice is taken when the note starts, so its Note Off follows its own start
+            if (playNoteAt(nowUs + i * strumMs * 1000, ch, inst, notes[i], durationMs, vel)) played++;
+        }
+        endBatch();
+        if (debug) Serial.printf("[MIDI] playChordAsync ch=%d inst=%d notes=%d/%d dur=%u strum=%u\n", ch, (uint8_t)inst, played, count, durationMs, strumMs);
+        return played;
+    }
+
+    /*
+      playChordAsync(channel, inst, symbol, octave, durationMs, vel, voicing, strumMs)
+      Same from a chord symbol ("Dm7", "F#maj9", "Bb/D", ...; see MIDI_Chords.h),
+      root in octave (4 = around middle C). Voicing::Smooth moves each chord the
+      least from the previous one played this way. Returns false if the symbol
+      is not understood.
+    */
+    bool playChordAsync(uint8_t channel, Instrument inst, const char *symbol, int8_t octave, uint32_t durationMs,
+                        uint8_t vel = 110, Voicing voicing = Voicing::Close, uint32_t strumMs = 0) {
+        uint8_t notes[CHORD_MAX_NOTES];
+        uint8_t count = chordVoicer.voice(symbol, octave, voicing, notes);
+        if (count == 0) {
+            if (debug) Serial.printf("[MIDI] unknown chord '%s'\n", symbol ? symbol : "");
+            return false;
+        }
+        Note chord[CHORD_MAX_NOTES];
+        for (uint8_t i = 0; i < count; i++) chord[i] = (Note)notes[i];
+        playChordAsync(channel, inst, chord, count, durationMs, vel, strumMs);
+        return true;
+    }
+
+    /*
+      playDrum(drum, vel)
+      Plays a percussion hit on DRUM_CHANNEL. Drum hits are one-shots: no
+      Program Change is sent and no voice slot is used, the Note Off simply
+      follows after the drum release time (see setDrumRelease()).
+    */
+    void playDrum(Drum drum, uint8_t vel = 110) {
+        playDrumHit((uint8_t)drum, vel);
+        if (debug) Serial.printf("[MIDI] playDrum note=%d vel=%d\n", (int)drum, vel);
+    }
+
+    /*
+      setDrumRelease(ms)
+      Time between a drum Note On and its Note Off (default 30 ms, 0 = at once).
+      The GM kit plays its samples to the end either way; the Note Off only
+      keeps receivers that track notes happy.
+    */
+    void setDrumRelease(uint32_t ms) { drumReleaseMs = ms; }
+
+    // ------------------ Output sinks ------------------
+
+    /*
+      addSink(sink) / removeSink(sink)
+      Mirror every MIDI message the library sends (sequencer, helpers, thru,
+      raw) to an extra output such as a UartMidiSink. Up to SEQ_MAX_SINKS.
+      SCI register writes (bass, SCI_VOL fades) only affect the VS1053.
+    */
+    bool addSink(MidiSink *sink) {
+        if (sink == nullptr || sinkCount >= SEQ_MAX_SINKS) return false;
+        sinks[sinkCount++] = sink;
+        return true;
+    }
+
+    void removeSink(MidiSink *sink) {
+        for (uint8_t i = 0; i < sinkCount; i++) {
+            if (sinks[i] != sink) continue;
+            sinks[i] = sinks[--sinkCount];
+            return;
+        }
+    }
+
+    /*
+      setVS1053Output(enable)
+      Turn the VS1053 MIDI output off to drive only the sinks (default: on).
+    */
+    void setVS1053Output(bool enable) {
+        vs1053Output = enable;
+        runningStatus = 0;
+    }
+
+    /*
+      setClockOutput(sink)
+      Sends MIDI clock (24 pulses per quarter note at the playback tempo) to
+      sink while the sequencer runs, plus Start (startSequencer()), Stop
+      (stopSequencer() or the end of a one-shot song) and Song Position +
+      Continue (continueSequencer()). nullptr turns the clock off.
+      The pulses are timed by a high resolution esp_timer, not by update(), so
+      they keep sub-millisecond spacing however often update() is called. They
+      are written from the esp_timer task with sink->writeRealtime()
+      (UartMidiSink sends them directly to the UART; a custom sink must make
+      that call thread-safe, see MidiSink) and never touch the VS1053 SPI path.
+      The timer task reads the sink under a lock, so it is safe to change or
+      clear it while the clock runs (a pulse being sent right then still goes
+      to the previous sink, which must stay valid).
+    */
+    void setClockOutput(MidiSink *sink) {
+        stopClock();
+        if (sink != nullptr && clockTimer == nullptr) {
+            esp_timer_create_args_t args = {};
+            args.callback = &VS1053_MIDI::clockTimerCallback;
+            args.arg = this;
+            args.name = "midi_clock";
+            if (esp_timer_create(&args, &clockTimer) != ESP_OK) {
+                clockTimer = nullptr;
+                if (debug) Serial.println("[CLK] timer create failed");
+                return;
+            }
+        }
+        portENTER_CRITICAL(&clockLock);
+        clockSink = sink;
+        portEXIT_CRITICAL(&clockLock);
+        if (clockSink != nullptr && sequencerRunning) startClock();
+    }
+
+    /*
+      setClockSource(source)
+      ClockSource::External makes the sequencer follow MIDI clock passed to
+      receiveClock() (MidiInput does it for every clock byte it reads):
+        - Start / Continue start the sequencer on the next clock pulse,
+          Stop stops it, Song Position moves it while stopped
+        - tempo and phase are estimated from the pulses by a phase-locked loop,
+          so the jitter of the incoming pulses does not reach the note timing
+        - the remaining position error is corrected by running slightly faster
+          or slower (setClockDriftCorrection()) instead of jumping
+      A clock output (setClockOutput()) then re-sends the smoothed clock.
+    */
+    void setClockSource(ClockSource source) {
+        clockSource = source;
+        extPulses = 0;
+        extLocked = false;
+        extTransport = 0;
+        if (source == ClockSource::Internal) updateTempoRate();
+    }
+
+    /*
+      setClockLockTime(ms)
+      Time constant of the clock PLL. Shorter follows tempo changes faster,
+      longer filters more jitter. Default: 500 ms.
+    */
+    void setClockLockTime(uint32_t ms) { clockLockMs = ms > 0 ? ms : 1; }
+
+    /*
+      setClockDriftCorrection(ms)
+      A position error against the external clock is removed over about ms
+      (0 = tempo only, no phase correction). Default: 250 ms.
+    */
+    void setClockDriftCorrection(uint32_t ms) { clockDriftMs = ms; }
+
+    /*
+      receiveClock(status, timestampUs)
+      Feeds one realtime byte of an external clock: 0xF8 (clock), 0xFA (Start),
+      0xFB (Continue) or 0xFC (Stop). timestampUs is the micros() it arrived at.
+      Ignored while the clock source is Internal.
+    */
+    void receiveClock(uint8_t status, uint32_t timestampUs) {
+        if (clockSource != ClockSource::External) return;
+        switch (status) {
+            case 0xF8: externalPulse(timestampUs); break;
+            case 0xFA: extTransport = 0xFA; extPulseCount = 0; break;
+            case 0xFB: extTransport = 0xFB; break;
+            case 0xFC:
+                extTransport = 0;
+                if (sequencerRunning) stopSequencer();
+                break;
+            default: break;
+        }
+    }
+
+    /*
+      receiveSongPosition(sixteenths)
+      Song Position Pointer of an external clock; used by the next Continue.
+    */
+    void receiveSongPosition(uint16_t sixteenths) {
+        if (clockSource != ClockSource::External || sequencerRunning) return;
+        extPulseCount = (uint32_t)sixteenths * 6;
+    }
+
+    // true while the PLL follows a steady external clock
+    bool isClockLocked() const {
+        if (clockSource != ClockSource::External || !extLocked) return false;
+        // no pulse for 4 periods: the master is gone
+        return (micros() - extLastPulseUs) < ((extPeriodQ8 >> 8) * 4);
+    }
+
+    // ------------------ Raw MIDI output ------------------
+
+    /*
+      sendRaw(data, len)
+      Forwards a raw MIDI byte stream (e.g. from a parser, a file or the
+      network). The stream may use running status, contain realtime bytes
+      anywhere and SysEx; a message may also be split across calls. Messages
+      are re-encoded through the same batched, running-status output as every
+      other message and the whole buffer goes out in as few SPI bursts as possible.
+      Program Change and CC#7 update the library's caches like the helpers do.
+      A SysEx longer than MIDI_SYSEX_MAX is dropped rather than forwarded cut
+      short (raise MIDI_SYSEX_MAX, or use sendSysEx() for long dumps).
+    */
+    void sendRaw(const uint8_t *data, size_t len) {
+        beginBatch();
+        for (size_t i = 0; i < len; i++) {
+            switch (rawParser.feed(data[i])) {
+                case MidiParseResult::Message: sendMessage(rawParser.message()); break;
+                case MidiParseResult::SysEx:
+                    if (!rawParser.sysexTruncated()) sendSysEx(rawParser.sysexData(), rawParser.sysexLength());
+                    else if (debug) Serial.println("[MIDI] SysEx over MIDI_SYSEX_MAX dropped");
+                    break;
+                default: break;
+            }
+        }
+        endBatch();
+    }
+
+    /*
+      sendMessages(msgs, count) / sendMessage(msg)
+      Same as sendRaw() for already split messages.
+    */
+    void sendMessages(const MidiMessage *msgs, size_t count) {
+        beginBatch();
+        for (size_t i = 0; i < count; i++) sendMessage(msgs[i]);
+        endBatch();
+    }
+
+    void sendMessage(const MidiMessage &m) {
+        uint8_t status = m.status;
+        if (status < 0x80) return;
+        if (status >= 0xF0) {
+            uint8_t msg[3] = { status, (uint8_t)(m.data1 & 0x7F), (uint8_t)(m.data2 & 0x7F) };
+            sendSystem(msg, 1 + MidiParser::dataLength(status));
+            return;
+        }
+        uint8_t ch = status & 0x0F;
+        uint8_t d1 = m.data1 & 0x7F, d2 = m.data2 & 0x7F;
+        switch (status & 0xF0) {
+            case 0x90:
+                usedChannelMask |= 1 << ch;
+                break;
+            case 0xB0:
+                sendControl(ch, d1, d2);   // keeps the CC#7 / ducking state
+                if (txBatchDepth == 0) flushMIDI();
+                return;
+            case 0xC0:
+                lastChannelInstrument[ch] = d1;
+                break;
+        }
+        talkMIDI(status, d1, d2);
+    }
+
+    /*
+      sendSysEx(data, len)
+      Sends F0 <data> F7 (data without the framing bytes), any length: the
+      bytes are streamed through the batched output (a long dump goes out in
+      several SPI bursts) and handed to each sink with writeSysEx().
+    */
+    void sendSysEx(const uint8_t *data, size_t len) {
+        if (vs1053Output) {
+            queueMIDI(0xF0);
+            for (size_t i = 0; i < len; i++) queueMIDI(data[i] & 0x7F);
+            queueMIDI(0xF7);
+            runningStatus = 0;
+        }
+        for (uint8_t s = 0; s < sinkCount; s++) sinks[s]->writeSysEx(data, len);
+        if (txBatchDepth == 0) flushMIDI();
+    }
+
+    // ------------------ Timestamped MIDI ------------------
+    /*
+      The *At() functions queue a message for an absolute micros() timestamp.
+      update() sends it once that time has come, through the same dispatch
+      path as sequencer events (a timestamp in the past is sent on the next
+      update()). Pre-schedule whole bursts instead of polling millis(), e.g. a
+      strummed chord:
+        uint32_t t = micros();
+        for (int i = 0; i < 3; i++) midi.playNoteAt(t + i * 8000, 0, inst, notes[i], 1200);
+      Events sharing the exact same timestamp are not guaranteed to keep their
+      call order. Each returns false when SEQ_MAX_SCHEDULED events are pending.
+    */
+
+    // play a note (Program Change if needed, Note On, automatic Note Off after durationMs)
+    bool playNoteAt(uint32_t timeUs, uint8_t channel, Instrument inst, Note note, uint32_t durationMs, uint8_t vel = 110) {
+        SeqEvent e = makeEvent(SeqEventType::Note, 0, channel);
+        e.inst = inst;
+        e.note = note;
+        e.velocity = vel;
+        e.durationMs = durationMs;
+        return scheduleEvent(timeUs, e, SEQ_NO_TRACK);
+    }
+
+    // bare Note On / Note Off; the caller is responsible for pairing them
+    bool noteOnAt(uint32_t timeUs, uint8_t channel, Note note, uint8_t vel = 100) {
+        SeqEvent e = makeEvent(SeqEventType::NoteOn, 0, channel);
+        e.note = note;
+        e.velocity = vel;
+        return scheduleEvent(timeUs, e, SEQ_NO_TRACK);
+    }
+
+    bool noteOffAt(uint32_t timeUs, uint8_t channel, Note note, uint8_t vel = 64) {
+        SeqEvent e = makeEvent(SeqEventType::NoteOff, 0, channel);
+        e.note = note;
+        e.velocity = vel;
+        return scheduleEvent(timeUs, e, SEQ_NO_TRACK);
+    }
+
+    bool ccAt(uint32_t timeUs, uint8_t channel, uint8_t controller, uint8_t value) {
+        SeqEvent e = makeEvent(SeqEventType::ControlChange, 0, channel);
+        e.controller = controller & 0x7F;
+        e.value = value & 0x7F;
+        return scheduleEvent(timeUs, e, SEQ_NO_TRACK);
+    }
+
+    // bend: -8192..8191, 0 = center
+    bool pitchBendAt(uint32_t timeUs, uint8_t channel, int16_t bend) {
+        SeqEvent e = makeEvent(SeqEventType::PitchBend, 0, channel);
+        uint16_t v = bendToRaw(bend);
+        e.bendLsb = v & 0x7F;
+        e.bendMsb = (v >> 7) & 0x7F;
+        return scheduleEvent(timeUs, e, SEQ_NO_TRACK);
+    }
+
+    bool channelPressureAt(uint32_t timeUs, uint8_t channel, uint8_t pressure) {
+        SeqEvent e = makeEvent(SeqEventType::ChannelPressure, 0, channel);
+        e.pressure = pressure & 0x7F;
+        return scheduleEvent(timeUs, e, SEQ_NO_TRACK);
+    }
+
+    bool programChangeAt(uint32_t timeUs, uint8_t channel, Instrument inst) {
+        SeqEvent e = makeEvent(SeqEventType::ProgramChange, 0, channel);
+        e.program = inst;
+        return scheduleEvent(timeUs, e, SEQ_NO_TRACK);
+    }
+
+    // number of timestamped events still waiting
+    uint8_t pendingScheduled() const { return scheduledCount; }
+
+    // drop all timestamped events that have not been sent yet
+    void clearScheduled() { scheduledCount = 0; }
+
+    // ------------------- Sequencer API -------------------
+
+    /*
+      clearTrack(track)
+      Remove all events and automation lanes from a specified track.
+    */
+    void clearTrack(uint8_t track) {
+        if (track >= SEQ_MAX_TRACKS || inSongLoader()) return;
+        trackEventCount[track] = 0;
+        trackLoopLengthMs[track] = 0;
+        trackCursor[track] = 0;
+        trackMode[track] = TrackMode::Events;
+        for (int l = 0; l < SEQ_MAX_LANES; l++) {
+            if (lanes[l].used && lanes[l].track == track) lanes[l].used = false;
+        }
+    }
+
+    /*
+      addEvent(track, timeOffsetMs, channel, inst, note, vel, durationMs)
+      Add a note event to the specified track. Returns true on success.
+      timeOffsetMs is relative to track start (in milliseconds).
+      Events may be added in any order; they are inserted sorted by time (events
+      with equal times keep their insertion order). Appending in time order, as
+      TrackComposer does, costs no shifting at all.
+    */
+    bool addEvent(uint8_t track, uint32_t timeOffsetMs, uint8_t channel, Instrument inst, Note note, uint8_t vel, uint32_t durationMs) {
+        SeqEvent e = makeEvent(SeqEventType::Note, timeOffsetMs, channel);
+        e.inst = inst;
+        e.note = note;
+        e.velocity = vel;
+        e.durationMs = durationMs;
+        if (!insertEvent(track, e)) return false;
+        if (debug) Serial.printf("[SEQ] addEvent tr=%d t=%d ch=%d inst=%d note=%d vel=%d dur=%d\n", (int)track, (int)timeOffsetMs, (int)channel, (int)inst, (int)note, (int)vel, (int)durationMs);
+        return true;
+    }
+
+    /*
+      addControlChange(track, timeOffsetMs, channel, controller, value)
+      Add a CC event (volume swell, pan sweep, ...). Returns true on success.
+    */
+    bool addControlChange(uint8_t track, uint32_t timeOffsetMs, uint8_t channel, uint8_t controller, uint8_t value) {
+        SeqEvent e = makeEvent(SeqEventType::ControlChange, timeOffsetMs, channel);
+        e.controller = controller & 0x7F;
+        e.value = value & 0x7F;
+        return insertEvent(track, e);
+    }
+
+    /*
+      addPitchBend(track, timeOffsetMs, channel, bend)
+      Add a pitch bend event. bend: -8192..8191, 0 = center.
+    */
+    bool addPitchBend(uint8_t track, uint32_t timeOffsetMs, uint8_t channel, int16_t bend) {
+        SeqEvent e = makeEvent(SeqEventType::PitchBend, timeOffsetMs, channel);
+        uint16_t v = bendToRaw(bend);
+        e.bendLsb = v & 0x7F;
+        e.bendMsb = (v >> 7) & 0x7F;
+        return insertEvent(track, e);
+    }
+
+    /*
+      addChannelPressure(track, timeOffsetMs, channel, pressure)
+      Add a channel pressure (aftertouch) event. pressure: 0..127
+    */
+    bool addChannelPressure(uint8_t track, uint32_t timeOffsetMs, uint8_t channel, uint8_t pressure) {
+        SeqEvent e = makeEvent(SeqEventType::ChannelPressure, timeOffsetMs, channel);
+        e.pressure = pressure & 0x7F;
+        return insertEvent(track, e);
+    }
+
+    /*
+      addProgramChange(track, timeOffsetMs, channel, inst)
+      Add an instrument change that is not tied to a note. Like setInstrument(),
+      it is skipped on playback when the channel already has that instrument.
+    */
+    bool addProgramChange(uint8_t track, uint32_t timeOffsetMs, uint8_t channel, Instrument inst) {
+        SeqEvent e = makeEvent(SeqEventType::ProgramChange, timeOffsetMs, channel);
+        e.program = inst;
+        return insertEvent(track, e);
+    }
+
+    /*
+      addTempo(track, timeOffsetMs, bpm)
+      Add a tempo change. From that point on the whole sequencer plays at bpm
+      (see setTempo()). Tempo changes persist across loop passes; put one at
+      time 0 if every pass should start at the same tempo.
+    */
+    bool addTempo(uint8_t track, uint32_t timeOffsetMs, float bpm) {
+        SeqEvent e = makeEvent(SeqEventType::Tempo, timeOffsetMs, 0);
+        e.tempoCentiBpm = bpmToCenti(bpm);
+        return insertEvent(track, e);
+    }
+
+    // ------------------- Automation API -------------------
+
+    /*
+      addAutomationLane(track, channel, target, minIntervalMs)
+      Creates an automation lane for CC number `target` (or AUTOMATION_PITCH_BEND)
+      on `channel`, following the timeline of `track`. minIntervalMs limits how
+      often the lane may send (the value is also only sent when it changed).
+      Returns the lane id, or -1 if all SEQ_MAX_LANES lanes are in use.
+    */
+    int8_t addAutomationLane(uint8_t track, uint8_t channel, uint8_t target, uint16_t minIntervalMs = 10) {
+        if (track >= SEQ_MAX_TRACKS) return -1;
+        for (int l = 0; l < SEQ_MAX_LANES; l++) {
+            AutomationLane &ln = lanes[l];
+            if (ln.used) continue;
+            ln.used = true;
+            ln.track = track;
+            ln.channel = channel & 0x0F;
+            ln.target = target;
+            ln.pointCount = 0;
+            ln.segment = 0;
+            ln.minIntervalMs = minIntervalMs;
+            ln.lastValue = LANE_NO_VALUE;
+            ln.lastSentMs = 0;
+            if (debug) Serial.printf("[AUTO] lane %d tr=%d ch=%d target=%d\n", l, track, channel, target);
+            return (int8_t)l;
+        }
+        if (debug) Serial.println("[AUTO] WARNING: no free automation lanes!");
+        return -1;
+    }
+
+    /*
+      addAutomationPoint(lane, timeOffsetMs, value, curve)
+      Adds a breakpoint (kept sorted by time). curve shapes the segment towards
+      the next breakpoint. value: 0..127 for CCs, -8192..8191 for pitch bend.
+    */
+    bool addAutomationPoint(int8_t lane, uint32_t timeOffsetMs, int16_t value, Curve curve = Curve::Linear) {
+        if (lane < 0 || lane >= SEQ_MAX_LANES || !lanes[lane].used) return false;
+        AutomationLane &ln = lanes[lane];
+        if (ln.pointCount >= SEQ_MAX_BREAKPOINTS) return false;
+        if (ln.target == AUTOMATION_PITCH_BEND) value = constrain(value, -8192, 8191);
+        else value = constrain(value, 0, 127);
+        uint8_t pos = ln.pointCount;
+        while (pos > 0 && ln.points[pos - 1].timeOffsetMs > timeOffsetMs) {
+            ln.points[pos] = ln.points[pos - 1];
+            pos--;
+        }
+        ln.points[pos].timeOffsetMs = timeOffsetMs;
+        ln.points[pos].value = value;
+        ln.points[pos].curve = curve;
+        ln.pointCount++;
+        // the pattern must be long enough to reach the last breakpoint
+        if (timeOffsetMs > trackLoopLengthMs[ln.track]) trackLoopLengthMs[ln.track] = timeOffsetMs;
+        return true;
+    }
+
+    /*
+      removeAutomationLane(lane)
+      Frees a lane. The controller keeps its last value.
+    */
+    void removeAutomationLane(int8_t lane) {
+        if (lane < 0 || lane >= SEQ_MAX_LANES) return;
+        lanes[lane].used = false;
+    }
+
+    /*
+      setTrackTranspose(track, semitones) / setTrackScale(track, scale, root)
+      Per-track pitch processing applied when the notes are played (the
+      stored events do not change): notes are transposed, then moved to the
+      nearest note of scale (ties go down). root is the scale's key, 0 = C ..
+      11 = B. Both are folded into one 128 entry table per track, so playing
+      costs one lookup. Drum notes are never changed.
+      Change them between notes: a Note Off is mapped with the table in use
+      when it is sent.
+    */
+    void setTrackTranspose(uint8_t track, int8_t semitones) {
+        if (track >= SEQ_MAX_TRACKS) return;
+        trackTranspose[track] = semitones;
+        buildNoteMap(track);
+    }
+
+    void setTrackScale(uint8_t track, Scale scale, uint8_t root = 0) {
+        if (track >= SEQ_MAX_TRACKS) return;
+        trackScaleMask[track] = (uint16_t)scale;
+        trackScaleRoot[track] = root % 12;
+        buildNoteMap(track);
+    }
+
+    /*
+      setSwing(track, percent, gridMs)
+      Delays the events on every second subdivision of gridMs (e.g. 125 =
+      sixteenths at 120 BPM): 50 % = straight, 66 % = triplet feel, up to 75 %.
+      Applied while playing, the stored events stay untouched, so it can be
+      changed at any time.
+    */
+    void setSwing(uint8_t track, uint8_t percent, uint16_t gridMs) {
+        if (track >= SEQ_MAX_TRACKS) return;
+        trackSwing[track] = constrain(percent, 50, 75);
+        trackSwingGridMs[track] = gridMs;
+        updateFeelMask(track);
+    }
+
+    /*
+      setHumanize(track, timingMs, velocity)
+      Moves each note by a random -timingMs..+timingMs (max 50) and changes its
+      velocity by up to +-velocity. The random sequence restarts with the
+      sequencer, so a playback can be repeated exactly. Events that end up
+      later than their position wait in the timestamp queue; the track is
+      read timingMs ahead so early ones are sent in time (the first events of
+      a loop are never early).
+    */
+    void setHumanize(uint8_t track, uint8_t timingMs, uint8_t velocity = 0) {
+        if (track >= SEQ_MAX_TRACKS) return;
+        trackHumanizeMs[track] = timingMs > 50 ? 50 : timingMs;
+        trackHumanizeVel[track] = velocity > 64 ? 64 : velocity;
+        updateFeelMask(track);
+    }
+
+    /*
+      setDrumTrack(track, enable)
+      Drum mode: all notes of the track are played on DRUM_CHANNEL as drum
+      hits (no Program Change, no voice slot, fixed release), whatever
+      channel they were added on. Notes added on DRUM_CHANNEL get the same
+      treatment on any track.
+    */
+    void setDrumTrack(uint8_t track, bool enable = true) {
+        if (track >= SEQ_MAX_TRACKS) return;
+        if (enable) drumTrackMask |= (1UL << track);
+        else drumTrackMask &= ~(1UL << track);
+    }
+
+    // add a percussion hit to a track (on DRUM_CHANNEL)
+    bool addDrum(uint8_t track, uint32_t timeOffsetMs, Drum drum, uint8_t vel = 110, uint32_t durationMs = 0) {
+        return addEvent(track, timeOffsetMs, DRUM_CHANNEL, Instrument::AcousticGrandPiano, (Note)drum, vel, durationMs);
+    }
+
+    // ------------------- Grid tracks -------------------
+
+    /*
+      setGridTrack(track, steps, stepMs, channel, inst)
+      Turns track into a step-sequencer grid of steps (1..SEQ_GRID_STEPS) steps,
+      stepMs apart, with SEQ_GRID_LANES lanes. The track loses its events and
+      loops every steps * stepMs like any other track. Notes last half a step
+      (see setGridGate()).
+    */
+    bool setGridTrack(uint8_t track, uint8_t steps, uint32_t stepMs, uint8_t channel, Instrument inst) {
+        if (track >= SEQ_MAX_TRACKS || steps == 0 || steps > SEQ_GRID_STEPS || stepMs == 0 || inSongLoader()) return false;
+        clearTrack(track);
+        GridTrack &g = tracks[track].grid;
+        trackMode[track] = TrackMode::Grid;
+        g.steps = steps;
+        g.channel = channel & 0x0F;
+        g.inst = inst;
+        g.stepMs = stepMs;
+        g.gateMs = stepMs > 1 ? stepMs / 2 : 1;
+        for (int l = 0; l < SEQ_GRID_LANES; l++) {
+            g.laneNote[l] = (uint8_t)Note::C4;
+            g.laneVelocity[l] = 100;
+        }
+        for (int s = 0; s < SEQ_GRID_STEPS; s++) g.stepLanes[s] = 0;
+        g.accentSteps = 0;
+        g.accentVelocity = 127;
+        trackLoopLengthMs[track] = steps * stepMs;
+        return true;
+    }
+
+    // note and velocity played by a lane
+    void setGridLane(uint8_t track, uint8_t lane, Note note, uint8_t vel = 100) {
+        if (track >= SEQ_MAX_TRACKS || trackMode[track] != TrackMode::Grid || lane >= SEQ_GRID_LANES) return;
+        tracks[track].grid.laneNote[lane] = (uint8_t)note;
+        tracks[track].grid.laneVelocity[lane] = vel & 0x7F;
+    }
+
+    // drum lane (use DRUM_CHANNEL or setDrumTrack() for the grid)
+    void setGridLane(uint8_t track, uint8_t lane, Drum drum, uint8_t vel = 100) {
+        setGridLane(track, lane, (Note)drum, vel);
+    }
+
+    // switch one step of a lane on or off
+    void setGridStep(uint8_t track, uint8_t lane, uint8_t step, bool on = true) {
+        if (track >= SEQ_MAX_TRACKS || trackMode[track] != TrackMode::Grid || lane >= SEQ_GRID_LANES || step >= tracks[track].grid.steps) return;
+        if (on) tracks[track].grid.stepLanes[step] |= (1 << lane);
+        else tracks[track].grid.stepLanes[step] &= ~(1 << lane);
+    }
+
+    /*
+      setGridPattern(track, lane, pattern)
+      Sets a whole lane from a string, one character per step:
+      'x' or 'X' = hit, anything else = rest. E.g. "x...x...x...x...".
+    */
+    void setGridPattern(uint8_t track, uint8_t lane, const char *pattern) {
+        if (track >= SEQ_MAX_TRACKS || trackMode[track] != TrackMode::Grid || pattern == nullptr) return;
+        for (uint8_t s = 0; s < tracks[track].grid.steps && pattern[s] != '\0'; s++) {
+            setGridStep(track, lane, s, pattern[s] == 'x' || pattern[s] == 'X');
+        }
+    }
+
+    // accent a step: every hit on it uses the accent velocity
+    void setGridAccent(uint8_t track, uint8_t step, bool on = true) {
+        if (track >= SEQ_MAX_TRACKS || trackMode[track] != TrackMode::Grid || step >= tracks[track].grid.steps) return;
+        if (on) tracks[track].grid.accentSteps |= (1UL << step);
+        else tracks[track].grid.accentSteps &= ~(1UL << step);
+    }
+
+    void setGridAccentVelocity(uint8_t track, uint8_t vel) {
+        if (track >= SEQ_MAX_TRACKS || trackMode[track] != TrackMode::Grid) return;
+        tracks[track].grid.accentVelocity = vel & 0x7F;
+    }
+
+    // note length of the grid hits (default: half a step)
+    void setGridGate(uint8_t track, uint32_t gateMs) {
+        if (track >= SEQ_MAX_TRACKS || trackMode[track] != TrackMode::Grid) return;
+        tracks[track].grid.gateMs = gateMs > 0 ? gateMs : 1;
+    }
+
+    // ------------------- Generator tracks -------------------
+
+    /*
+      setGeneratorTrack(track, steps, stepMs, channel, inst, note, vel)
+      Turns track into a rhythm generator of steps steps (1..255), stepMs
+      apart, playing note. Nothing is expanded into events: each step is
+      decided when it is reached, so all parameters below can be changed while
+      playing, in O(1), and take effect from the next step.
+      Starts as "every step, always played"; shape it with setEuclid(),
+      setStepProbability() and setRatchet().
+    */
+    bool setGeneratorTrack(uint8_t track, uint8_t steps, uint32_t stepMs, uint8_t channel, Instrument inst,
+                           Note note, uint8_t vel = 100) {
+        if (track >= SEQ_MAX_TRACKS || steps == 0 || stepMs == 0 || inSongLoader()) return false;
+        clearTrack(track);
+        GeneratorTrack &g = tracks[track].generator;
+        trackMode[track] = TrackMode::Generator;
+        g.steps = steps;
+        g.pulses = steps;
+        g.rotation = 0;
+        g.probability = 100;
+        g.ratchetChance = 0;
+        g.ratchetCount = 2;
+        g.channel = channel & 0x0F;
+        g.inst = inst;
+        g.note = (uint8_t)note;
+        g.velocity = vel & 0x7F;
+        g.stepMs = stepMs;
+        g.gateMs = stepMs > 1 ? stepMs / 2 : 1;
+        g.seed = 0x1234567 + track;
+        g.rng = g.seed;
+        trackLoopLengthMs[track] = steps * stepMs;
+        return true;
+    }
+
+    // Euclidean rhythm: pulses hits spread evenly over the steps, shifted by rotation
+    void setEuclid(uint8_t track, uint8_t pulses, uint8_t rotation = 0) {
+        if (track >= SEQ_MAX_TRACKS || trackMode[track] != TrackMode::Generator) return;
+        GeneratorTrack &g = tracks[track].generator;
+        g.pulses = pulses > g.steps ? g.steps : pulses;
+        g.rotation = rotation % g.steps;
+    }
+
+    // chance (0..100 %) that each pulse is actually played
+    void setStepProbability(uint8_t track, uint8_t percent) {
+        if (track >= SEQ_MAX_TRACKS || trackMode[track] != TrackMode::Generator) return;
+        tracks[track].generator.probability = percent > 100 ? 100 : percent;
+    }
+
+    // chance (0..100 %) that a played hit is repeated count times within its step
+    void setRatchet(uint8_t track, uint8_t percent, uint8_t count = 2) {
+        if (track >= SEQ_MAX_TRACKS || trackMode[track] != TrackMode::Generator) return;
+        tracks[track].generator.ratchetChance = percent > 100 ? 100 : percent;
+        tracks[track].generator.ratchetCount = count < 2 ? 2 : count;
+    }
+
+    // seed of the random sequence (used from the next startSequencer())
+    void setGeneratorSeed(uint8_t track, uint32_t seed) {
+        if (track >= SEQ_MAX_TRACKS || trackMode[track] != TrackMode::Generator) return;
+        tracks[track].generator.seed = seed != 0 ? seed : 1;   // xorshift must not start at 0
+    }
+
+    // note and velocity of the generated hits, and their length
+    void setGeneratorNote(uint8_t track, Note note, uint8_t vel, uint32_t gateMs = 0) {
+        if (track >= SEQ_MAX_TRACKS || trackMode[track] != TrackMode::Generator) return;
+        GeneratorTrack &g = tracks[track].generator;
+        g.note = (uint8_t)note;
+        g.velocity = vel & 0x7F;
+        if (gateMs > 0) g.gateMs = gateMs;
+    }
+
+    // ------------------- Patterns and arrangement -------------------
+
+    /*
+      Patterns are event lists kept once in a pool of SEQ_MAX_PATTERNS; an
+      arranged track plays them by reference at the places listed with
+      arrangePattern(), so a 4 bar pattern repeated 30 times costs one 8 byte
+      entry instead of 30 copies of its events. Fill the patterns before
+      arranging them and while the sequencer is stopped.
+    */
+
+    /*
+      clearPattern(pattern, lengthMs)
+      Empties a pattern. lengthMs is the length of one repeat: the next repeat
+      starts there even if notes still ring (their Note Off comes from their
+      duration), and events after it are refused. 0 = up to the end of the
+      last note added.
+    */
+    void clearPattern(uint8_t pattern, uint32_t lengthMs = 0) {
+        SongSlot *target = editTarget();
+        if (pattern >= SEQ_MAX_PATTERNS || target == nullptr) return;
+        target->patterns[pattern].eventCount = 0;
+        target->patterns[pattern].fixedLength = lengthMs > 0;
+        target->patterns[pattern].lengthMs = lengthMs;
+        updateArrangementLengths(target);
+    }
+
+    /*
+      addPatternNote(pattern, timeOffsetMs, channel, inst, note, vel, durationMs)
+      addEvent() for a pattern: times are relative to the start of the pattern.
+    */
+    bool addPatternNote(uint8_t pattern, uint32_t timeOffsetMs, uint8_t channel, Instrument inst, Note note, uint8_t vel, uint32_t durationMs) {
+        SeqEvent e = makeEvent(SeqEventType::Note, timeOffsetMs, channel);
+        e.inst = inst;
+        e.note = note;
+        e.velocity = vel;
+        e.durationMs = durationMs;
+        return addPatternEvent(pattern, e);
+    }
+
+    /*
+      addPatternEvent(pattern, ev)
+      Inserts any SeqEvent (time relative to the pattern start) sorted by time.
+      With a fixed length, events after it are refused; one exactly at the
+      end (e.g. the NoteOff of a NoteOn) plays right before the next repeat.
+    */
+    bool addPatternEvent(uint8_t pattern, const SeqEvent &e) {
+        SongSlot *target = editTarget();
+        if (pattern >= SEQ_MAX_PATTERNS || target == nullptr) return false;
+        Pattern &p = target->patterns[pattern];
+        if (p.eventCount >= SEQ_PATTERN_EVENTS) return false;
+        if (p.fixedLength && e.timeOffsetMs > p.lengthMs) return false;
+        uint16_t pos = p.eventCount;
+        while (pos > 0 && p.events[pos - 1].timeOffsetMs > e.timeOffsetMs) {
+            p.events[pos] = p.events[pos - 1];
+            pos--;
+        }
+        p.events[pos] = e;
+        p.eventCount++;
+        if (p.fixedLength) return true;
+        uint32_t end = e.timeOffsetMs + (e.kind() == SeqEventType::Note ? e.durationMs : 0);
+        if (end > p.lengthMs) {
+            p.lengthMs = end;
+            updateArrangementLengths(target);
+        }
+        return true;
+    }
+
+    /*
+      storePattern(pattern, track, lengthMs)
+      Moves the events of an event track into a pattern (replacing its
+      content) and clears the track, so patterns can be written with
+      addEvent(), addControlChange(), TrackComposer, ... on a scratch track.
+      lengthMs is the length of one repeat as in clearPattern(); 0 takes the
+      track length. Returns false if the pattern is too small for the track,
+      an event lies after lengthMs, or it is called from a song loader.
+    */
+    bool storePattern(uint8_t pattern, uint8_t track, uint32_t lengthMs = 0) {
+        SongSlot *target = editTarget();
+        if (pattern >= SEQ_MAX_PATTERNS || track >= SEQ_MAX_TRACKS || !isEventTrack(track)) return false;
+        if (target == nullptr || inSongLoader()) return false;
+        uint16_t count = trackEventCount[track];
+        if (count > SEQ_PATTERN_EVENTS) return false;
+        if (lengthMs > 0 && count > 0 && tracks[track].events[count - 1].timeOffsetMs > lengthMs) return false;
+        Pattern &p = target->patterns[pattern];
+        memcpy(p.events, tracks[track].events, count * sizeof(SeqEvent));
+        p.eventCount = count;
+        p.fixedLength = lengthMs > 0;
+        p.lengthMs = lengthMs > 0 ? lengthMs : trackLoopLengthMs[track];
+        clearTrack(track);
+        updateArrangementLengths(target);
+        if (debug) Serial.printf("[SEQ] pattern %d: %d events, %u ms\n", (int)pattern, p.eventCount, p.lengthMs);
+        return true;
+    }
+
+    /*
+      arrangePattern(track, pattern, startMs, repeat, transpose)
+      Places pattern on track at startMs, played repeat times back to back and
+      transposed by transpose semitones. The first call turns the track into
+      an arranged track (its events are dropped). Placements on one track
+      should not overlap; layer patterns on different tracks instead.
+      Returns false when the track has SEQ_ARRANGE_ENTRIES placements.
+    */
+    bool arrangePattern(uint8_t track, uint8_t pattern, uint32_t startMs, uint16_t repeat = 1, int8_t transpose = 0) {
+        if (track >= SEQ_MAX_TRACKS || pattern >= SEQ_MAX_PATTERNS || repeat == 0 || inSongLoader()) return false;
+        Arrangement &a = tracks[track].arrangement;
+        if (trackMode[track] != TrackMode::Arranged) {
+            clearTrack(track);
+            trackMode[track] = TrackMode::Arranged;
+            a.entryCount = 0;
+            a.entry = 0;
+            a.repeat = 0;
+            a.endMs = UINT32_MAX;
+        }
+        if (a.entryCount >= SEQ_ARRANGE_ENTRIES) return false;
+        uint8_t pos = a.entryCount;
+        while (pos > 0 && a.entries[pos - 1].startMs > startMs) {
+            a.entries[pos] = a.entries[pos - 1];
+            pos--;
+        }
+        ArrangeEntry &e = a.entries[pos];
+        e.startMs = startMs;
+        e.repeat = repeat;
+        e.pattern = pattern;
+        e.transpose = transpose;
+        a.entryCount++;
+        updateArrangementLength(track);
+        return true;
+    }
+
+    // ------------------- Song sections -------------------
+
+    /*
+      A song is an order of sections, a section says which pattern (from the
+      pattern pool) each track plays for how long. While the song plays,
+      queueSection() changes what comes next without stopping anything:
+      "play the chorus from the next bar" is queueSection(CHORUS, barMs).
+    */
+
+    /*
+      setSection(section, lengthMs)
+      Defines (or resets) a section lengthMs long with all tracks silent.
+    */
+    bool setSection(uint8_t section, uint32_t lengthMs) {
+        SongSlot *target = editTarget();
+        if (section >= SEQ_MAX_SECTIONS || lengthMs == 0 || target == nullptr) return false;
+        Section &s = target->sections[section];
+        s.lengthMs = lengthMs;
+        for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
+            s.pattern[t] = SEQ_NO_PATTERN;
+            s.transpose[t] = 0;
+        }
+        return true;
+    }
+
+    /*
+      setSectionPattern(section, track, pattern, transpose)
+      track plays pattern during section, repeated (the last repeat is cut
+      at the section end) and transposed by transpose semitones.
+      SEQ_NO_PATTERN silences the track again.
+    */
+    bool setSectionPattern(uint8_t section, uint8_t track, uint8_t pattern, int8_t transpose = 0) {
+        SongSlot *target = editTarget();
+        if (target == nullptr || section >= SEQ_MAX_SECTIONS || target->sections[section].lengthMs == 0 || track >= SEQ_MAX_TRACKS) return false;
+        if (pattern >= SEQ_MAX_PATTERNS && pattern != SEQ_NO_PATTERN) return false;
+        target->sections[section].pattern[track] = pattern;
+        target->sections[section].transpose[track] = transpose;
+        return true;
+    }
+
+    /*
+      setSongOrder(order, count, loop)
+      The sections played one after the other (ids may repeat). loop = true
+      starts over after the last one, otherwise the song ends there.
+    */
+    bool setSongOrder(const uint8_t *order, uint8_t count, bool loop = false) {
+        SongSlot *target = editTarget();
+        if (count > SEQ_SONG_LENGTH || target == nullptr) return false;
+        for (uint8_t i = 0; i < count; i++) {
+            if (order[i] >= SEQ_MAX_SECTIONS || target->sections[order[i]].lengthMs == 0) return false;
+        }
+        memcpy(target->order, order, count);
+        target->orderCount = count;
+        target->loop = loop;
+        return true;
+    }
+
+    /*
+      startSong(orderIndex)
+      Starts the sequencer on the song order at orderIndex. Every track used
+      by a section becomes an arranged track driven by the sections (its
+      events and placements are replaced); other tracks play once from the
+      song start, as in a one-shot playback. The song ends (onSongEnd())
+      after the last section unless the order loops.
+    */
+    bool startSong(uint8_t orderIndex = 0) {
+        if (orderIndex >= song->orderCount) return false;
+        for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
+            if (((songTrackMask >> t) & 1) && trackMode[t] == TrackMode::Arranged) {
+                tracks[t].arrangement.entryCount = 0;   // tracks of the last song
+            }
+        }
+        songTrackMask = 0;
+        addSongTracks(*song);
+        startSequencer(0, false);
+        songPlaying = true;
+        songIndex = orderIndex;
+        queuedSection = SEQ_NO_SECTION;
+        pendingSlot = SEQ_NO_SLOT;
+        enterSection(song->order[orderIndex], 0);
+        return true;
+    }
+
+    /*
+      queueSection(section, quantizeMs)
+      Plays section next: at the next multiple of quantizeMs counted from the
+      start of the current section (e.g. one bar), or at the end of the
+      current section when quantizeMs is 0. The song order then continues
+      after the place of section in it. A later call replaces the request.
+      Explicit NoteOns and sustain the cut section leaves on are released at
+      the boundary (see enterSection()).
+    */
+    bool queueSection(uint8_t section, uint32_t quantizeMs = 0) {
+        if (!songPlaying || !sequencerRunning || section >= SEQ_MAX_SECTIONS || song->sections[section].lengthMs == 0) return false;
+        uint32_t pos = advancePosition();
+        if (songSection == SEQ_NO_SECTION) {
+            // the order has run out (last notes still sounding): start right away
+            enterSection(section, pos);
+            return true;
+        }
+        uint32_t boundary = sectionBoundary(pos, quantizeMs);
+        queuedSection = section;
+        setSectionEnd(boundary);
+        if (debug) Serial.printf("[SONG] section %d queued for %u ms\n", (int)section, boundary);
+        return true;
+    }
+
+    // section playing now (SEQ_NO_SECTION when no song is playing)
+    uint8_t currentSection() const { return songPlaying ? songSection : SEQ_NO_SECTION; }
+
+    // ------------------- Song slots -------------------
+
+    /*
+      SEQ_SONG_SLOTS songs can be kept in memory at once. The pattern,
+      section and song order calls write to the slot chosen with
+      selectSlot() (slot 0 by default); the sequencer plays another one, so
+      the next song can be prepared while the current one plays. The loader
+      task of loadSlot() writes to the slot it loads instead, and the other
+      code cannot write to that slot until it is loaded.
+    */
+
+    // the slot written by the pattern and section calls (false while it is loading)
+    bool selectSlot(uint8_t slot) {
+        if (slot >= SEQ_SONG_SLOTS || slotLoading[slot]) return false;
+        editSong = &songs[slot];
+        return true;
+    }
+
+    /*
+      loadSlot(slot, loader, arg)
+      Empties slot and fills it by calling loader(midi, arg) in a low
+      priority FreeRTOS task, so parsing and sorting a song never delays
+      update(). The pattern and section calls the loader makes go to slot;
+      the same calls from other code keep going to the selectSlot() slot
+      (they fail if that is slot). The track calls fail in the loader (see
+      SongLoader). Returns false if slot is the played one, a load is
+      already running, or the task could not be started. isSlotReady()
+      tells when the slot can be played.
+    */
+    bool loadSlot(uint8_t slot, SongLoader loader, void *arg = nullptr) {
+        if (slot >= SEQ_SONG_SLOTS || loader == nullptr || &songs[slot] == song || slot == pendingSlot) return false;
+        for (int i = 0; i < SEQ_SONG_SLOTS; i++) {
+            if (slotLoading[i]) return false;
+        }
+        loadingSlot = slot;
+        songLoader = loader;
+        songLoaderArg = arg;
+        slotLoading[slot] = true;
+        if (xTaskCreate(songLoadTask, "songload", SEQ_LOAD_TASK_STACK, this, SEQ_LOAD_TASK_PRIO, nullptr) != pdPASS) {
+            slotLoading[slot] = false;
+            return false;
+        }
+        return true;
+    }
+
+    // false while slot is being loaded
+    bool isSlotReady(uint8_t slot) const { return slot < SEQ_SONG_SLOTS && !slotLoading[slot]; }
+
+    // the slot being played
+    uint8_t playingSlot() const { return (uint8_t)(song - songs); }
+
+    /*
+      switchTo(slot, beats)
+      Plays the song in slot from the start of its order, taking over at the
+      next multiple of beats beats (at the song tempo) counted from the start
+      of the current section, or at the end of the section when beats is 0.
+      The swap happens inside update() exactly at that boundary, like a
+      section change: no stop, no gap, and notes the old song left on are
+      released at the boundary (see enterSection()). Without a song playing,
+      the slot starts at once (startSong()).
+    */
+    bool switchTo(uint8_t slot, uint8_t beats = 1) {
+        if (slot >= SEQ_SONG_SLOTS || slotLoading[slot] || songs[slot].orderCount == 0) return false;
+        if (!songPlaying || !sequencerRunning || songSection == SEQ_NO_SECTION) {
+            song = &songs[slot];
+            return startSong(0);
+        }
+        uint32_t beatMs = 6000000UL / songTempoCentiBpm;   // song time
+        uint32_t boundary = sectionBoundary(advancePosition(), beatMs * beats);
+        pendingSlot = slot;
+        queuedSection = SEQ_NO_SECTION;
+        setSectionEnd(boundary);
+        if (debug) Serial.printf("[SONG] slot %d queued for %u ms\n", (int)slot, boundary);
+        return true;
+    }
+
+    // ------------------- Live recording -------------------
+
+    /*
+      recordArm(track, channel, inst, quantizeMs)
+      Records the notes received through receiveNoteOn()/receiveNoteOff()
+      (MidiInput calls them for every note it reads) into track while the
+      sequencer runs. Notes from any input channel are written on channel with
+      instrument inst; times are taken from the loop position.
+        - quantizeMs > 0 snaps each note start to the nearest multiple of
+          quantizeMs (0 = keep the played timing)
+        - the note is stored when it is released, merged into the sorted track
+          next to the events already there (overdub); clearTrack() first to
+          record from scratch
+      Give the loop a fixed length (startSequencer(loopMs)) when recording
+      into empty tracks. Recording never allocates: a pending note is one
+      entry of a 128 note table.
+    */
+    bool recordArm(uint8_t track, uint8_t channel, Instrument inst, uint32_t quantizeMs = 0) {
+        if (track >= SEQ_MAX_TRACKS || !isEventTrack(track)) return false;
+        recordTrack = track;
+        recordChannel = channel & 0x0F;
+        recordInstrument = inst;
+        recordQuantizeMs = quantizeMs;
+        for (int n = 0; n < 128; n++) recordVelocity[n] = 0;
+        if (debug) Serial.printf("[REC] armed tr=%d ch=%d q=%u\n", (int)track, (int)recordChannel, quantizeMs);
+        return true;
+    }
+
+    // stop recording; notes still held are dropped
+    void recordDisarm() { recordTrack = SEQ_NO_TRACK; }
+
+    bool isRecording() const { return recordTrack != SEQ_NO_TRACK; }
+
+    /*
+      receiveNoteOn(channel, note, vel) / receiveNoteOff(channel, note)
+      Note input for recording and the arpeggiator (vel 0 = note off). They do
+      not play the note itself: sound it yourself (or let MidiInput thru do it)
+      when neither is active.
+    */
+    void receiveNoteOn(uint8_t channel, uint8_t note, uint8_t vel) {
+        if (vel == 0) { receiveNoteOff(channel, note); return; }
+        note &= 0x7F;
+        if (arpEnabled) arpHold(note, vel & 0x7F);
+        if (recordTrack == SEQ_NO_TRACK || !sequencerRunning) return;
+        recordStartMs[note] = patternPositionMs();
+        recordVelocity[note] = vel & 0x7F;
+    }
+
+    void receiveNoteOff(uint8_t channel, uint8_t note) {
+        (void)channel;
+        note &= 0x7F;
+        if (arpEnabled) arpRelease(note);
+        if (recordTrack == SEQ_NO_TRACK || recordVelocity[note] == 0) return;
+        uint8_t vel = recordVelocity[note];
+        recordVelocity[note] = 0;
+        if (!sequencerRunning) return;
+        recordNote(note, vel, recordStartMs[note], patternPositionMs());
+    }
+
+    // ------------------- Groove templates -------------------
+
+    /*
+      extractGroove(track, gridMs, groove)
+      Measures the feel of an event track (typically one recorded without
+      quantize): each note is assigned to its nearest gridMs step, and per
+      step the average distance from the grid and the average velocity
+      difference to the whole track are stored in groove. The pattern loop
+      is split into at most SEQ_GROOVE_STEPS steps; steps without notes get no
+      offset. Returns false if the track has no notes.
+    */
+    bool extractGroove(uint8_t track, uint16_t gridMs, Groove &groove) {
+        if (track >= SEQ_MAX_TRACKS || !isEventTrack(track) || gridMs == 0) return false;
+        uint32_t steps = (patternLengthMs() + gridMs - 1) / gridMs;
+        groove.steps = (uint8_t)constrain(steps, 1, SEQ_GROOVE_STEPS);
+        groove.gridMs = gridMs;
+
+        int32_t timingSum[SEQ_GROOVE_STEPS] = {0};
+        int32_t velocitySum[SEQ_GROOVE_STEPS] = {0};
+        uint8_t hits[SEQ_GROOVE_STEPS] = {0};
+        int32_t totalVelocity = 0;
+        uint16_t notes = 0;
+        for (uint16_t i = 0; i < trackEventCount[track]; i++) {
+            const SeqEvent &ev = tracks[track].events[i];
+            SeqEventType k = ev.kind();
+            if ((k != SeqEventType::Note && k != SeqEventType::NoteOn) || ev.velocity == 0) continue;
+            uint32_t nearest = (ev.timeOffsetMs + gridMs / 2) / gridMs;
+            uint8_t step = nearest % groove.steps;
+            timingSum[step] += (int32_t)ev.timeOffsetMs - (int32_t)(nearest * gridMs);
+            velocitySum[step] += ev.velocity;
+            hits[step]++;
+            totalVelocity += ev.velocity;
+            notes++;
+        }
+        if (notes == 0) return false;
+
+        int32_t average = totalVelocity / notes;
+        for (uint8_t s = 0; s < groove.steps; s++) {
+            groove.timingMs[s] = hits[s] ? (int8_t)constrain(timingSum[s] / hits[s], -127, 127) : 0;
+            groove.velocity[s] = hits[s] ? (int8_t)constrain(velocitySum[s] / hits[s] - average, -127, 127) : 0;
+        }
+        if (debug) Serial.printf("[GROOVE] tr=%d %d notes -> %d steps of %u ms\n", (int)track, notes, groove.steps, gridMs);
+        return true;
+    }
+
+    /*
+      applyGroove(trackMask, groove, amount)
+      Plays the tracks in trackMask (bit t = track t, any track type) with
+      the feel of groove, scaled by amount % (100 = as extracted, more
+      exaggerates it, 0 or nullptr = off). Timing moves Note events only. The offsets are looked up per event while playing, the
+      stored events are not changed. groove is used by reference, so it must
+      stay valid while applied; it adds to setSwing()/setHumanize().
+    */
+    void applyGroove(uint32_t trackMask, const Groove *groove, uint8_t amount = 100) {
+        for (uint8_t t = 0; t < SEQ_MAX_TRACKS; t++) {
+            if (!((trackMask >> t) & 1)) continue;
+            bool on = groove != nullptr && groove->gridMs > 0 && groove->steps > 0 && amount > 0;
+            trackGroove[t] = on ? groove : nullptr;
+            trackGrooveAmount[t] = on ? amount : 0;
+            // early steps need the track read ahead (see feelLookaheadMs())
+            int8_t earliest = 0;
+            for (uint8_t s = 0; on && s < groove->steps; s++) {
+                if (groove->timingMs[s] < earliest) earliest = groove->timingMs[s];
+            }
+            trackGrooveEarlyMs[t] = (uint16_t)(-earliest * amount / 100);
+            updateFeelMask(t);
+        }
+    }
+
+    // ------------------- Arpeggiator -------------------
+
+    /*
+      arpEnable(channel, inst, mode, octaves, stepsPerBeat, gatePercent)
+      Starts the live arpeggiator: while notes are held (receiveNoteOn(), or
+      any MidiInput note), they are played one at a time on channel, in mode
+      order over octaves octaves (1..4), stepsPerBeat steps per quarter note
+      at the current tempo (4 = sixteenths; follows setTempo() and an external
+      clock), each note lasting gatePercent % of a step. The first note plays
+      as soon as a key is pressed. Held notes live in fixed buffers; steps are
+      sent through the timestamp queue.
+      With MidiInput, keep notes out of the thru path:
+      setThruFilter(MIDI_THRU_ALL & ~MIDI_THRU_NOTES & ~MIDI_THRU_SYSTEM).
+    */
+    void arpEnable(uint8_t channel, Instrument inst, ArpMode mode = ArpMode::Up, uint8_t octaves = 1,
+                   uint8_t stepsPerBeat = 4, uint8_t gatePercent = 50) {
+        arpChannel = channel & 0x0F;
+        arpInstrument = inst;
+        arpHeldCount = 0;
+        arpEnabled = true;
+        setArpMode(mode);
+        setArpOctaves(octaves);
+        setArpRate(stepsPerBeat);
+        setArpGate(gatePercent);
+    }
+
+    // stop the arpeggiator and forget the held notes
+    void arpDisable() {
+        arpEnabled = false;
+        arpHeldCount = 0;
+    }
+
+    void setArpMode(ArpMode mode) { arpMode = mode; }
+    void setArpOctaves(uint8_t octaves) { arpOctaves = constrain(octaves, 1, 4); }
+    void setArpRate(uint8_t stepsPerBeat) { arpStepsPerBeat = stepsPerBeat > 0 ? stepsPerBeat : 1; }
+    void setArpGate(uint8_t percent) { arpGatePercent = constrain(percent, 1, 100); }
+
+    /*
+      setPan(channel, pan)
+      Send Control Change #10 (Pan) for given channel. pan: 0..127
+    */
+    void setPan(uint8_t channel, uint8_t pan) {
+        if (pan > 127) {
+            if (debug) Serial.println("[MIDI] Warning: Pan value too high! Clamping to 127.");
+            pan = 127;
+        }
+    
+        talkMIDI(0xB0 | (channel & 0x0F), 10, pan); // CC#10 = Pan
+        if (debug) Serial.printf("[MIDI] setPan ch=%d pan=%d\n", channel, pan);
+    }
+
+    /*
+      setBassBoost(bass)
+      Small helper to write to VS1053 register to increase bass.
+      bass: 0..15
+    */
+    void setBassBoost(uint8_t bass) {
+        if (bass > 15) {
+            if (debug) Serial.println("[MIDI] Warning: Bass boost value too high! Clamping to 15.");
+            bass = 15;
+        }
+        writeRegister(0x02, (bass & 0x0F) << 4, 0x00);
+        if (debug) Serial.printf("[MIDI] setBassBoost=%d\n", bass);
+    }
+
+    /*
+      setReverb(reverb)
+      Send CC#91 (Reverb Send). value: 0..127
+    */
+    void setReverb(uint8_t reverb) {
+        if (reverb > 127) {
+            if (debug) Serial.println("[MIDI] Warning: Reverb value too high! Clamping to 127.");
+            reverb = 127;
+        }
+        talkMIDI(0xB0, 91, reverb); // CC#91 = Reverb Send
+        if (debug) Serial.printf("[MIDI] setReverb=%d\n", reverb);
+    }
+
+    /*
+      setMasterVolume(volume)
+      Send CC#7 (Master Volume). value: 0..127
+    */
+    void setMasterVolume(uint8_t volume) {
+        if (volume > 127) {
+            if (debug) Serial.println("[MIDI] Warning: Master volume value too high! Clamping to 127.");
+            volume = 127;
+        }
+    
+        cancelFade(0);             // an explicit value cancels a running fade
+        sendControl(0, 7, volume); // CC#7 = Master Volume
+        if (debug) Serial.printf("[MIDI] setMasterVolume=%d\n", volume);
+    }
+
+    /*
+      setChannelVolume(channel, volume)
+      Send CC#7 on a specific channel (Channel Volume).
+    */
+    void setChannelVolume(uint8_t channel, uint8_t volume) {
+        if (volume > 127) {
+            if (debug) Serial.println("[MIDI] Warning: Channel volume value too high! Clamping to 127.");
+            volume = 127;
+        }
+    
+        cancelFade(channel & 0x0F);   // an explicit value cancels a running fade
+        sendControl(channel & 0x0F, 7, volume);
+        if (debug) Serial.printf("[MIDI] setChannelVolume ch=%d vol=%d\n", channel, volume);
+    }
+
+    // last CC#7 value sent on a channel (100 until set)
+    uint8_t getChannelVolume(uint8_t channel) const { return channelVolume[channel & 0x0F]; }
+
+    /*
+      setOutputVolume(volume)
+      Sets the VS1053 output volume through the SCI_VOL register, after all MIDI
+      channels. volume: 0..127, each step is 1 dB (127 = 0 dB, 0 = silence).
+    */
+    void setOutputVolume(uint8_t volume) {
+        if (volume > 127) volume = 127;
+        cancelFade(FADE_MASTER);
+        writeOutputAttenuation((127 - volume) * 2);
+        if (debug) Serial.printf("[MIDI] setOutputVolume=%d\n", volume);
+    }
+
+    /*
+      fadeTo(channel, target, durationMs, curve)
+      Ramps the volume of a channel (CC#7) to target (0..127) over durationMs,
+      without blocking: the ramp is advanced by update() and a CC is only sent
+      when the value actually changes. Use FADE_MASTER as channel to fade the
+      global output volume instead (SCI_VOL, 0.5 dB steps, same 0..127 scale as
+      setOutputVolume()), which is smoother than CC#7 steps.
+      A new fade or an explicit set*Volume() call replaces a running fade.
+    */
+    void fadeTo(uint8_t channel, uint8_t target, uint32_t durationMs, Curve curve = Curve::Linear) {
+        if (target > 127) target = 127;
+        uint8_t slot = (channel == FADE_MASTER) ? FADE_MASTER : (channel & 0x0F);
+        Fade &f = fades[slot];
+        if (!f.active) activeFadeCount++;
+        f.active = true;
+        f.curve = curve;
+        if (slot == FADE_MASTER) {
+            // fade in attenuation units (0.5 dB)
+            f.from = outputAttenuation;
+            f.to = (127 - target) * 2;
+        } else {
+            f.from = channelVolume[slot];
+            f.to = target;
+        }
+        f.startMs = millis();
+        f.durationMs = durationMs;
+        if (debug) Serial.printf("[FADE] ch=%d %d -> %d in %u ms\n", slot, f.from, f.to, durationMs);
+        if (durationMs == 0) updateFades(f.startMs);
+    }
+
+    // true while a fade is running on channel (or FADE_MASTER)
+    bool isFading(uint8_t channel) const {
+        return fades[(channel == FADE_MASTER) ? FADE_MASTER : (channel & 0x0F)].active;
+    }
+
+    // ------------------- Alerts (priority layer) -------------------
+
+    /*
+      setAlertChannels(mask)
+      Channels reserved for alerts (bit n = channel n). Default: channel 15.
+      Background music should not use them; they are never ducked.
+    */
+    void setAlertChannels(uint16_t mask) { alertChannelMask = mask; }
+
+    /*
+      setAlertVoices(count)
+      Voice slots kept free for alert notes. Sequencer and playNoteAsync() notes
+      only get SEQ_MAX_VOICES - count slots (stealing among themselves), so an
+      alert never has to wait for a voice. Default: SEQ_ALERT_VOICES.
+    */
+    void setAlertVoices(uint8_t count) { alertReservedVoices = count < SEQ_MAX_VOICES ? count : SEQ_MAX_VOICES - 1; }
+
+    /*
+      setDucking(level, attackMs, releaseMs)
+      While an alert sounds, every non-alert channel that has played a note is faded to level/127 of its
+      cached CC#7 volume within attackMs, and faded back within releaseMs after
+      the last alert note was released. level 127 disables ducking.
+    */
+    void setDucking(uint8_t level, uint32_t attackMs, uint32_t releaseMs) {
+        duckLevel = level > 127 ? 127 : level;
+        duckAttackMs = attackMs;
+        duckReleaseMs = releaseMs;
+    }
+
+    /*
+      playAlert(channel, inst, note, durationMs, vel)
+      Plays an alert note right away, ahead of anything queued, on a reserved
+      voice, and ducks the background. Call it from the loop() context; from an
+      ISR or another task use requestAlert().
+    */
+    void playAlert(uint8_t channel, Instrument inst, Note note, uint32_t durationMs, uint8_t vel = 127) {
+        uint8_t ch = channel & 0x0F;
+        setInstrument(ch, inst);
+        int slot = claimVoice(SEQ_ALERT_TRACK);
+        noteOn(ch, note, vel);
+        flushMIDI();   // out now, even in the middle of an update() burst
+        occupyVoice(slot, ch, (uint8_t)note, millis() + durationMs, SEQ_ALERT_TRACK);
+        duckBackground();
+        if (debug) Serial.printf("[ALERT] ch=%d note=%d dur=%u\n", ch, (uint8_t)note, durationMs);
+    }
+
+    /*
+      requestAlert(channel, inst, note, durationMs, vel)
+      ISR / task safe variant of playAlert(): queues the alert (no SPI access)
+      and update() plays it first thing, and between events while it is sending
+      a burst of sequencer events. Several tasks and ISRs may call it at once
+      (the enqueue is a short critical section). Returns false if the queue is
+      full.
+    */
+    bool requestAlert(uint8_t channel, Instrument inst, Note note, uint32_t durationMs, uint8_t vel = 127) {
+        bool queued = false;
+        portENTER_CRITICAL_SAFE(&alertLock);
+        uint8_t next = (alertHead + 1) % SEQ_ALERT_QUEUE;
+        if (next != alertTail) {
+            AlertRequest &r = alertQueue[alertHead];
+            r.channel = channel;
+            r.inst = inst;
+            r.note = note;
+            r.velocity = vel;
+            r.durationMs = durationMs;
+            alertHead = next;   // publish after the request is complete
+            queued = true;
+        }
+        portEXIT_CRITICAL_SAFE(&alertLock);
+        return queued;
+    }
+
+    // true while an alert note is sounding
+    bool isAlertPlaying() const { return alertVoiceCount > 0; }
+
+    /*
+      setSongTempo(bpm)
+      Declares the tempo the event times (ms) were written at. Default: 120 BPM.
+      Playback runs at real time while setTempo() equals this value.
+    */
+    void setSongTempo(float bpm) {
+        songTempoCentiBpm = bpmToCenti(bpm);
+        updateTempoRate();
+    }
+
+    /*
+      setTempo(bpm)
+      Changes the playback tempo. Event times and note durations are scaled by
+      songTempo / bpm, so setTempo(240) on a 120 BPM song plays it twice as fast.
+      Takes effect smoothly from the current position (no jump).
+    */
+    void setTempo(float bpm) {
+        tempoCentiBpm = bpmToCenti(bpm);
+        updateTempoRate();
+        if (debug) Serial.printf("[SEQ] tempo=%u.%02u\n", tempoCentiBpm / 100, tempoCentiBpm % 100);
+    }
+
+    // current playback tempo in BPM
+    float getTempo() const { return tempoCentiBpm / 100.0f; }
+
+    /*
+      startSequencer(loopMs, looping)
+      Starts the sequencer. If loopMs == 0, loop length is computed automatically
+      as the longest track length. Otherwise, the whole pattern loops every loopMs.
+      With looping == false the song is played once (loopMs is ignored): the
+      sequencer stops by itself after the last event has been played and its
+      note released, and the onSongEnd() callback is fired.
+    */
+    void startSequencer(uint32_t loopMs = 0, bool looping = true) {
+        sequencerPosUs = 0;
+        sequencerPosFrac = 0;
+        lastPositionUs = micros();
+        sequencerRunning = true;
+        sequencerLooping = looping;
+        sequencerCycle = 0;
+        globalLoopMs = loopMs;
+        songPlaying = false;
+        // rewind all tracks for a fresh start
+        for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
+            rewindTrack(t);
+            if (trackMode[t] == TrackMode::Generator) tracks[t].generator.rng = tracks[t].generator.seed;
+            trackHumanizeRng[t] = 0x9E3779B9u + t;
+        }
+        if (clockSink != nullptr) {
+            sendClockByte(0xFA);   // Start
+            startClock();
+        }
+        if (debug) Serial.printf("[SEQ] started (%s)\n", looping ? "loop" : "one-shot");
+    }
+
+    /*
+      stopSequencer()
+      Stop the sequencer loop. The position is kept for continueSequencer().
+    */
+    void stopSequencer() {
+        sequencerRunning = false;
+        dropTrackScheduled();
+        for (uint8_t t = 0; t < SEQ_MAX_TRACKS; t++) {
+            if (trackMode[t] == TrackMode::Arranged) releaseHeld(t);
+        }
+        if (clockSink != nullptr) {
+            stopClock();
+            sendClockByte(0xFC);   // Stop
+        }
+        if (debug) Serial.println("[SEQ] stopped");
+    }
+
+    /*
+      continueSequencer()
+      Resumes a stopped sequencer from where it was stopped. The position is
+      moved back to the last sixteenth note so a clock slave can follow it:
+      Song Position Pointer and Continue are sent on the clock output.
+    */
+    void continueSequencer() {
+        if (sequencerRunning) return;
+        uint32_t sixteenthUs = 1500000000UL / songTempoCentiBpm;   // 15e6 us * 100 / centiBPM
+        uint32_t sixteenths = (uint32_t)(sequencerPosUs / sixteenthUs);
+        if (sixteenths > 0x3FFF) sixteenths = 0x3FFF;              // 14-bit Song Position
+        sequencerPosUs = (uint64_t)sixteenths * sixteenthUs;
+        sequencerPosFrac = 0;
+        lastPositionUs = micros();
+        sequencerRunning = true;
+        if (clockSink != nullptr) {
+            uint8_t spp[3] = { 0xF2, (uint8_t)(sixteenths & 0x7F), (uint8_t)(sixteenths >> 7) };
+            clockSink->write(spp, 3);
+            clockSink->flush();     // Song Position must reach the slave before Continue
+            sendClockByte(0xFB);    // Continue
+            startClock();
+        }
+        if (debug) Serial.printf("[SEQ] continued at 16th %u\n", sixteenths);
+    }
+
+    /*
+      isSequencerRunning()
+      True while the sequencer is playing. A one-shot playback turns this off
+      by itself once the song is over.
+    */
+    bool isSequencerRunning() const { return sequencerRunning; }
+
+    /*
+      onSongEnd(cb)
+      Register a function called when a one-shot playback finishes
+      (nullptr to remove it). Looping playback never ends by itself.
+    */
+    void onSongEnd(SongEndCallback cb) { songEndCallback = cb; }
+
+    /*
+      Scheduler hooks (pass nullptr to remove). See the callback typedefs above.
+      Use them to sync LEDs, motors etc. to the music without re-implementing
+      the sequencer timing in the sketch.
+    */
+    void onEventFired(EventFiredCallback cb) { eventFiredCallback = cb; }
+    void onLoopWrap(LoopWrapCallback cb) { loopWrapCallback = cb; }
+    void onVoiceStolen(VoiceStolenCallback cb) { voiceStolenCallback = cb; }
+    void onLate(LateCallback cb) { lateCallback = cb; }
+    void onSectionChange(SectionChangeCallback cb) { sectionChangeCallback = cb; }
+
+    /*
+      setLateThreshold(ms)
+      Events sent more than ms after their scheduled time are reported through
+      onLate(). Default: 2 ms.
+    */
+    void setLateThreshold(uint32_t ms) { lateThresholdMs = ms; }
+
+    /*
+      update()
+      Must be called frequently (typically from the loop()).
+      - processes scheduled noteOffs (voice management)
+      - plays sequencer events at correct times, respecting track loops
+      Each track keeps a cursor on its next pending event, so a call with
+      nothing due only compares one timestamp per track. When the sequencer is
+      stopped and no note is waiting for its noteOff, update() returns at once.
+      NOTE: setInstrument() is used when a sequencer event requires an instrument change,
+            but the setInstrument() internal check avoids duplicate Program Change messages.
+    */
+    void update() {
+        // idle fast path: nothing playing, nothing to release, no fade running
+        // keep slow sinks (UART) transmitting
+        for (uint8_t i = 0; i < sinkCount; i++) sinks[i]->poll();
+
+        if (!sequencerRunning && activeVoiceCount == 0 && activeFadeCount == 0 && scheduledCount == 0 && alertHead == alertTail
+            && arpHeldCount == 0) return;
+
+        // everything sent during this update goes out as one SPI burst
+        beginBatch();
+        runScheduler();
+        endBatch();
+    }
+
+private:
+    /*
+      runScheduler()
+      The body of update(): alerts, fades, noteOffs, timestamped events, then
+      sequencer tracks and automation.
+    */
+    void runScheduler() {
+        // queued alerts go out before anything else
+        if (alertHead != alertTail) serviceAlerts();
+
+        uint32_t now = millis();
+
+        if (activeFadeCount > 0) updateFades(now);
+
+        // Handle scheduled voice offs (only when the earliest one is due):
+        if (activeVoiceCount > 0 && (int32_t)(now - nextVoiceOffMs) >= 0) releaseDueVoices(now);
+
+        // arpeggiator steps join the timestamped events
+        if (arpHeldCount > 0) updateArp();
+
+        // timestamped events whose deadline has passed
+        if (scheduledCount > 0) dispatchScheduled(now);
+
+        if (!sequencerRunning) return;
+
+        // compute elapsed song time since sequencer start (tempo scaled)
+        uint32_t elapsed = advancePosition();
+
+        if (songPlaying) {
+            runSong(elapsed, now);
+            return;
+        }
+
+        if (!sequencerLooping) {
+            // one-shot: no wrapping, play everything up to the current position
+            bool pending = false;
+            for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
+                playTrackEvents(t, elapsed, elapsed, now);
+                if (!trackFinished(t)) pending = true;
+            }
+            if (updateAutomation(elapsed, now)) pending = true;
+            // the song is over once every event was played and released
+            if (!pending) finishOneShot();
+            return;
+        }
+
+        uint32_t patternLength = patternLengthMs();
+
+        uint32_t cycle = elapsed / patternLength;
+        uint32_t posInPattern = elapsed % patternLength;
+
+        if (cycle != sequencerCycle) {
+            // pattern wrapped — finish what is left of the previous cycle
+            // (events a late update() would otherwise skip), then rewind
+            for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
+                playTrackEvents(t, patternLength - 1, patternLength + posInPattern, now);
+                rewindTrack(t);
+            }
+            for (int l = 0; l < SEQ_MAX_LANES; l++) lanes[l].segment = 0;
+            sequencerCycle = cycle;
+            if (loopWrapCallback) loopWrapCallback(cycle);
+        }
+
+        // fire events whose timeOffset <= posInPattern
+        for (int t = 0; t < SEQ_MAX_TRACKS; t++) playTrackEvents(t, posInPattern, posInPattern, now);
+        updateAutomation(posInPattern, now);
+    }
+
+    // ends a one-shot playback once the last notes were released
+    void finishOneShot() {
+        if (hasSequencerVoices() || hasTrackScheduled()) return;
+        sequencerRunning = false;
+        songPlaying = false;
+        if (clockSink != nullptr) {
+            stopClock();
+            sendClockByte(0xFC);   // Stop
+        }
+        if (debug) Serial.println("[SEQ] one-shot finished");
+        if (songEndCallback) songEndCallback();
+    }
+
+    /*
+      runSong(elapsed, now)
+      runScheduler() for song playback. When update() passes a section
+      boundary, the old section plays its events before the boundary and
+      the next one takes over at the boundary itself, within the same call:
+      no gap, and no event is played by both sections. Tracks no section
+      uses play once from the song start.
+    */
+    void runSong(uint32_t elapsed, uint32_t now) {
+        while (songSection != SEQ_NO_SECTION && elapsed >= songSectionEndMs) {
+            for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
+                if ((songTrackMask >> t) & 1) playTrackEvents(t, songSectionEndMs - 1, elapsed, now);
+            }
+            nextSection(songSectionEndMs);
+        }
+        bool pending = songSection != SEQ_NO_SECTION;
+        for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
+            playTrackEvents(t, elapsed, elapsed, now);
+            if (!((songTrackMask >> t) & 1) && !trackFinished(t)) pending = true;
+        }
+        if (updateAutomation(elapsed, now)) pending = true;
+        if (!pending) finishOneShot();
+    }
+
+    /*
+      nextSection(startMs)
+      Starts the queued section, or else the next one of the song order, at
+      song time startMs.
+    */
+    void nextSection(uint32_t startMs) {
+        uint8_t next = SEQ_NO_SECTION;
+        if (pendingSlot != SEQ_NO_SLOT) {
+            // switchTo(): the new song starts from the top of its order
+            song = &songs[pendingSlot];
+            pendingSlot = SEQ_NO_SLOT;
+            addSongTracks(*song);
+            songIndex = 0;
+            next = song->order[0];
+        } else if (queuedSection != SEQ_NO_SECTION) {
+            next = queuedSection;
+            queuedSection = SEQ_NO_SECTION;
+            // carry on in the order after the requested section
+            for (uint8_t i = 0; i < song->orderCount; i++) {
+                if (song->order[i] == next) { songIndex = i; break; }
+            }
+        } else if (songIndex + 1 < song->orderCount) {
+            next = song->order[++songIndex];
+        } else if (song->loop && song->orderCount > 0) {
+            songIndex = 0;
+            next = song->order[0];
+        }
+        enterSection(next, startMs);
+    }
+
+    /*
+      sectionBoundary(pos, quantizeMs)
+      The next multiple of quantizeMs after pos, counted from the start of the
+      current section, but no later than the section end (0 = section end).
+    */
+    uint32_t sectionBoundary(uint32_t pos, uint32_t quantizeMs) const {
+        uint32_t boundary = songSectionStartMs + song->sections[songSection].lengthMs;
+        if (quantizeMs > 0 && pos >= songSectionStartMs) {
+            uint32_t next = songSectionStartMs + ((pos - songSectionStartMs) / quantizeMs + 1) * quantizeMs;
+            if (next < boundary) boundary = next;
+        }
+        return boundary;
+    }
+
+    // moves the end of the current section (a queued change) to boundary
+    void setSectionEnd(uint32_t boundary) {
+        songSectionEndMs = boundary;
+        for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
+            if (((songTrackMask >> t) & 1) && trackMode[t] == TrackMode::Arranged) tracks[t].arrangement.endMs = boundary;
+        }
+    }
+
+    /*
+      addSongTracks(s)
+      Adds the tracks used by the sections of s to songTrackMask and turns the
+      new ones into (empty) arranged tracks. Tracks of a previous song stay in
+      the mask and fall silent.
+    */
+    void addSongTracks(const SongSlot &s) {
+        for (int sec = 0; sec < SEQ_MAX_SECTIONS; sec++) {
+            if (s.sections[sec].lengthMs == 0) continue;
+            for (uint8_t t = 0; t < SEQ_MAX_TRACKS; t++) {
+                if (s.sections[sec].pattern[t] == SEQ_NO_PATTERN || ((songTrackMask >> t) & 1)) continue;
+                songTrackMask |= (1UL << t);
+                if (trackMode[t] == TrackMode::Arranged) continue;
+                clearTrack(t);
+                trackMode[t] = TrackMode::Arranged;
+                tracks[t].arrangement.entryCount = 0;
+            }
+        }
+    }
+
+    static void clearSong(SongSlot &s) {
+        for (int p = 0; p < SEQ_MAX_PATTERNS; p++) {
+            s.patterns[p].eventCount = 0;
+            s.patterns[p].fixedLength = false;
+            s.patterns[p].lengthMs = 0;
+        }
+        for (int sec = 0; sec < SEQ_MAX_SECTIONS; sec++) s.sections[sec].lengthMs = 0;
+        s.orderCount = 0;
+        s.loop = false;
+    }
+
+    // true when called from the loader task (see loadSlot())
+    bool inSongLoader() const {
+        return loaderTask != nullptr && xTaskGetCurrentTaskHandle() == loaderTask;
+    }
+
+    // slot the pattern and section calls write to; nullptr while it is loading
+    SongSlot *editTarget() {
+        if (inSongLoader()) return &songs[loadingSlot];
+        return slotLoading[editSong - songs] ? nullptr : editSong;
+    }
+
+    // body of the loader task started by loadSlot()
+    static void songLoadTask(void *param) {
+        VS1053_MIDI *midi = (VS1053_MIDI *)param;
+        uint8_t slot = midi->loadingSlot;
+        clearSong(midi->songs[slot]);
+        midi->loaderTask = xTaskGetCurrentTaskHandle();
+        midi->songLoader(*midi, midi->songLoaderArg);
+        midi->loaderTask = nullptr;
+        if (midi->debug) Serial.printf("[SONG] slot %d loaded\n", (int)slot);
+        midi->slotLoading[slot] = false;   // publish after the song is complete
+        vTaskDelete(nullptr);
+    }
+
+    /*
+      enterSection(section, startMs)
+      Points the arrangement of every section track at the section's pattern,
+      repeated from startMs to the end of the section. Notes and sustain the
+      old section left on (explicit NoteOn/CC 64 whose off fell after the
+      cut) are released first, so they end at the boundary.
+    */
+    void enterSection(uint8_t section, uint32_t startMs) {
+        songSection = section;
+        songSectionStartMs = startMs;
+        songSectionEndMs = section != SEQ_NO_SECTION ? startMs + song->sections[section].lengthMs : UINT32_MAX;
+        for (uint8_t t = 0; t < SEQ_MAX_TRACKS; t++) {
+            if (!((songTrackMask >> t) & 1) || trackMode[t] != TrackMode::Arranged) continue;
+            releaseHeld(t);   // the old section was cut: nothing may keep sounding
+            Arrangement &a = tracks[t].arrangement;
+            a.entryCount = 0;
+            a.endMs = songSectionEndMs;
+            uint8_t pattern = section != SEQ_NO_SECTION ? song->sections[section].pattern[t] : SEQ_NO_PATTERN;
+            if (pattern != SEQ_NO_PATTERN) {
+                uint32_t patternMs = song->patterns[pattern].lengthMs;
+                uint32_t repeat = patternMs > 0 ? (song->sections[section].lengthMs + patternMs - 1) / patternMs : 1;
+                ArrangeEntry &e = a.entries[0];
+                e.startMs = startMs;
+                e.repeat = (uint16_t)(repeat < UINT16_MAX ? repeat : UINT16_MAX);
+                e.pattern = pattern;
+                e.transpose = song->sections[section].transpose[t];
+                a.entryCount = 1;
+            }
+            rewindTrack(t);
+        }
+        if (debug) Serial.printf("[SONG] section %d at %u ms\n", (int)section, startMs);
+        if (sectionChangeCallback) sectionChangeCallback(section, startMs);
+    }
+
+    /*
+      trackHeld(t, ev)
+      Follows the explicit NoteOn/NoteOff and sustain (CC 64) events an
+      arranged track sends, so releaseHeld() can end them when the
+      arrangement is cut. Note events need nothing: their voice ends them.
+    */
+    void trackHeld(uint8_t t, const SeqEvent &ev) {
+        SeqEventType k = ev.kind();
+        if (k == SeqEventType::ControlChange) {
+            if (ev.controller != 64) return;
+            if (ev.value >= 64) heldSustain[t] |= (1 << ev.channel);
+            else heldSustain[t] &= ~(1 << ev.channel);
+            return;
+        }
+        if (k != SeqEventType::NoteOn && k != SeqEventType::NoteOff) return;
+        uint16_t key = (uint16_t)(ev.channel << 8) | ((uint8_t)ev.note & 0x7F);
+        for (uint8_t i = 0; i < heldCount[t]; i++) {
+            if (heldNotes[t][i] == key) {
+                heldNotes[t][i] = heldNotes[t][--heldCount[t]];
+                break;
+            }
+        }
+        if (k == SeqEventType::NoteOn && ev.velocity > 0) {
+            if (heldCount[t] < SEQ_HELD_NOTES) heldNotes[t][heldCount[t]++] = key;
+            else heldOverflow[t] |= (1 << ev.channel);   // released with All Notes Off
+        }
+    }
+
+    // ends what trackHeld() recorded for track t
+    void releaseHeld(uint8_t t) {
+        for (uint8_t i = 0; i < heldCount[t]; i++) {
+            noteOff(heldNotes[t][i] >> 8, (Note)(heldNotes[t][i] & 0x7F));
+        }
+        for (uint8_t ch = 0; ch < 16; ch++) {
+            if (heldSustain[t] & (1 << ch)) sendControl(ch, 64, 0);
+            if (heldOverflow[t] & (1 << ch)) sendControl(ch, 123, 0);
+        }
+        heldCount[t] = 0;
+        heldSustain[t] = 0;
+        heldOverflow[t] = 0;
+    }
+
+    /*
+      patternLengthMs()
+      Loop length of the pattern: globalLoopMs or the longest track.
+    */
+    uint32_t patternLengthMs() const {
+        if (globalLoopMs > 0) return globalLoopMs;
+        uint32_t patternLength = 0;
+        for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
+            if (trackLoopLengthMs[t] > patternLength) patternLength = trackLoopLengthMs[t];
+        }
+        return patternLength > 0 ? patternLength : 1; // avoid div zero
+    }
+
+    /*
+      seekPosition(posUs)
+      Moves the song position and points every track cursor at the first
+      event not yet played at that position.
+    */
+    void seekPosition(uint64_t posUs) {
+        sequencerPosUs = posUs;
+        sequencerPosFrac = 0;
+        uint32_t posMs = (uint32_t)(posUs / 1000);
+        if (sequencerLooping) {
+            uint32_t patternLength = patternLengthMs();
+            sequencerCycle = posMs / patternLength;
+            posMs %= patternLength;
+        }
+        for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
+            uint16_t i = 0;
+            uint32_t stepMs = trackStepMs(t);
+            if (trackMode[t] == TrackMode::Arranged) {
+                i = seekArrangement(t, posMs);
+            } else if (stepMs > 0) {
+                i = (uint16_t)((posMs + stepMs - 1) / stepMs);
+            } else {
+                while (i < trackEventCount[t] && tracks[t].events[i].timeOffsetMs < posMs) i++;
+            }
+            trackCursor[t] = i;
+        }
+        for (int l = 0; l < SEQ_MAX_LANES; l++) lanes[l].segment = 0;
+    }
+
+    /*
+      patternPositionMs()
+      Current position inside the pattern (the song position when playing once).
+    */
+    uint32_t patternPositionMs() {
+        uint32_t elapsed = advancePosition();
+        return sequencerLooping ? elapsed % patternLengthMs() : elapsed;
+    }
+
+    /*
+      recordNote(note, vel, startMs, endMs)
+      Quantizes a released note and merges it into the record track. A note
+      held across the loop end wraps; it is shortened to end at the loop end
+      so the pattern length does not grow.
+    */
+    void recordNote(uint8_t note, uint8_t vel, uint32_t startMs, uint32_t endMs) {
+        uint32_t patternLength = sequencerLooping ? patternLengthMs() : 0;
+        uint32_t dur = (endMs >= startMs) ? endMs - startMs : endMs + patternLength - startMs;
+        if (recordQuantizeMs > 0) {
+            startMs = ((startMs + recordQuantizeMs / 2) / recordQuantizeMs) * recordQuantizeMs;
+            if (patternLength > 0 && startMs >= patternLength) startMs = 0;
+        }
+        if (patternLength > 0 && startMs + dur > patternLength) dur = patternLength - startMs;
+        if (dur == 0) dur = 1;
+        SeqEvent e = makeEvent(SeqEventType::Note, startMs, recordChannel);
+        e.inst = recordInstrument;
+        e.note = (Note)note;
+        e.velocity = vel;
+        e.durationMs = dur;
+        uint16_t index;
+        bool ok = insertEvent(recordTrack, e, &index);
+        // the start is already behind the play position: do not replay it in this pass
+        if (ok && startMs <= endMs && index == trackCursor[recordTrack]) trackCursor[recordTrack]++;
+        if (debug) Serial.printf("[REC] tr=%d note=%d @%u dur=%u%s\n", (int)recordTrack, (int)note, startMs, dur, ok ? "" : " (track full)");
+    }
+
+    /*
+      arpHold(note, vel) / arpRelease(note)
+      Maintain the held note buffers: pressing order and a sorted copy
+      (insertion into at most ARP_MAX_NOTES entries, no allocation).
+    */
+    void arpHold(uint8_t note, uint8_t vel) {
+        for (uint8_t i = 0; i < arpHeldCount; i++) {
+            if (arpHeld[i] == note) { arpHeldVelocity[i] = vel; return; }
+        }
+        if (arpHeldCount >= ARP_MAX_NOTES) return;
+        if (arpHeldCount == 0) {
+            // first key: restart the pattern right away
+            arpStep = 0;
+            arpNextUs = micros();
+            arpNextFrac = 0;
+        }
+        arpHeld[arpHeldCount] = note;
+        arpHeldVelocity[arpHeldCount] = vel;
+        uint8_t pos = arpHeldCount;
+        while (pos > 0 && arpSorted[pos - 1] > note) {
+            arpSorted[pos] = arpSorted[pos - 1];
+            pos--;
+        }
+        arpSorted[pos] = note;
+        arpHeldCount++;
+    }
+
+    void arpRelease(uint8_t note) {
+        uint8_t i = 0;
+        while (i < arpHeldCount && arpHeld[i] != note) i++;
+        if (i == arpHeldCount) return;
+        for (; i + 1 < arpHeldCount; i++) {
+            arpHeld[i] = arpHeld[i + 1];
+            arpHeldVelocity[i] = arpHeldVelocity[i + 1];
+        }
+        i = 0;
+        while (arpSorted[i] != note) i++;
+        for (; i + 1 < arpHeldCount; i++) arpSorted[i] = arpSorted[i + 1];
+        arpHeldCount--;
+    }
+
+    /*
+      updateArp()
+      Queues the arpeggiator step that is due, at its exact deadline. The step
+      length follows the playback tempo and is accumulated in Q16 so the
+      pattern does not drift.
+    */
+    void updateArp() {
+        if ((int32_t)(micros() - arpNextUs) < 0) return;
+
+        uint8_t n = arpHeldCount;
+        uint16_t total = n * arpOctaves;   // notes in one sweep
+        uint16_t idx;
+        switch (arpMode) {
+            case ArpMode::Down:
+                idx = total - 1 - (arpStep % total);
+                break;
+            case ArpMode::UpDown: {
+                uint16_t period = total > 1 ? 2 * (total - 1) : 1;
+                idx = arpStep % period;
+                if (idx >= total) idx = period - idx;
+                break;
+            }
+            case ArpMode::Random:
+                idx = xorshift32(arpRng) % total;
+                break;
+            default:
+                idx = arpStep % total;
+                break;
+        }
+        uint8_t base = idx % n;
+        uint8_t note = (arpMode == ArpMode::AsPlayed) ? arpHeld[base] : arpSorted[base];
+        uint8_t vel = 100;
+        for (uint8_t i = 0; i < n; i++) {
+            if (arpHeld[i] == note) { vel = arpHeldVelocity[i]; break; }
+        }
+        int16_t played = note + 12 * (idx / n);
+        if (played > 127) played = 127;
+
+        // step length in us at the playback tempo: 60e6 * 100 / (centiBPM * steps per beat)
+        uint64_t stepQ16 = (((uint64_t)6000000000ULL) << 16) / ((uint64_t)tempoCentiBpm * arpStepsPerBeat) + arpNextFrac;
+        uint32_t stepUs = (uint32_t)(stepQ16 >> 16);
+
+        SeqEvent ev = makeEvent(SeqEventType::Note, 0, arpChannel);
+        ev.inst = arpInstrument;
+        ev.note = (Note)played;
+        ev.velocity = vel;
+        uint32_t gateMs = (uint32_t)(((uint64_t)stepUs * arpGatePercent) / 100000);
+        ev.durationMs = gateMs > 0 ? gateMs : 1;
+        scheduleEvent(arpNextUs, ev, SEQ_NO_TRACK);
+
+        arpNextUs += stepUs;
+        arpNextFrac = (uint16_t)(stepQ16 & 0xFFFF);
+        arpStep++;
+        // more than a step behind (update() was blocked): skip instead of bursting
+        if ((int32_t)(micros() - arpNextUs) > 0) arpNextUs = micros();
+    }
+
+    bool debug;
+
+    // sequencer storage
+    TrackStore tracks[SEQ_MAX_TRACKS];
+    TrackMode trackMode[SEQ_MAX_TRACKS];    // what tracks[t] holds
+    uint16_t heldNotes[SEQ_MAX_TRACKS][SEQ_HELD_NOTES];   // channel << 8 | note (see trackHeld())
+    uint8_t heldCount[SEQ_MAX_TRACKS];
+    uint16_t heldSustain[SEQ_MAX_TRACKS];   // bit ch = CC 64 held on ch
+    uint16_t heldOverflow[SEQ_MAX_TRACKS];  // bit ch = more notes held than SEQ_HELD_NOTES
+    uint16_t trackEventCount[SEQ_MAX_TRACKS];
+    uint32_t trackLoopLengthMs[SEQ_MAX_TRACKS];
+    uint16_t trackCursor[SEQ_MAX_TRACKS];   // index of the next event (grid: step) to play
+
+    // song slots: patterns, sections and order (see loadSlot())
+    SongSlot songs[SEQ_SONG_SLOTS];
+    SongSlot *song;                             // slot played (arranged tracks read its patterns)
+    SongSlot *editSong;                         // slot written by the pattern and section calls
+    volatile bool slotLoading[SEQ_SONG_SLOTS];  // cleared by the loader task when done
+    uint8_t loadingSlot;
+    TaskHandle_t volatile loaderTask;           // set while the loader runs
+    SongLoader songLoader;
+    void *songLoaderArg;
+    uint8_t pendingSlot;                    // switchTo() request (SEQ_NO_SLOT = none)
+    bool songPlaying;                       // the sequencer plays the song order
+    uint32_t songTrackMask;                 // bit t = track t is driven by the sections
+    uint8_t songIndex;                      // position in songOrder
+    uint8_t songSection;                    // section playing (SEQ_NO_SECTION = none)
+    uint8_t queuedSection;                  // next section requested with queueSection()
+    uint32_t songSectionStartMs;            // song time
+    uint32_t songSectionEndMs;              // where the next section takes over
+    uint32_t drumTrackMask;                 // bit t = track t is a drum track
+
+    // per-track transpose/scale (see setTrackTranspose())
+    int8_t trackTranspose[SEQ_MAX_TRACKS];
+    uint16_t trackScaleMask[SEQ_MAX_TRACKS];
+    uint8_t trackScaleRoot[SEQ_MAX_TRACKS];
+    uint8_t noteMap[SEQ_MAX_TRACKS][128];   // played note for each stored note
+    uint32_t noteMapMask;                   // bit t = track t has a non-identity map
+
+    // per-track feel (see setSwing(), setHumanize())
+    uint8_t trackSwing[SEQ_MAX_TRACKS];     // 50 = straight
+    uint16_t trackSwingGridMs[SEQ_MAX_TRACKS];
+    uint8_t trackHumanizeMs[SEQ_MAX_TRACKS];
+    uint8_t trackHumanizeVel[SEQ_MAX_TRACKS];
+    uint32_t trackHumanizeRng[SEQ_MAX_TRACKS];
+    const Groove *trackGroove[SEQ_MAX_TRACKS];   // see applyGroove()
+    uint8_t trackGrooveAmount[SEQ_MAX_TRACKS];
+    uint16_t trackGrooveEarlyMs[SEQ_MAX_TRACKS];   // up to 127 ms * 255 %
+    uint32_t feelMask;                      // bit t = track t has swing, humanize or a groove
+    uint32_t drumReleaseMs;
+
+    // sequencer state
+    bool sequencerRunning;
+    bool sequencerLooping;
+    uint64_t sequencerPosUs;                // song position since start, tempo scaled
+    uint16_t sequencerPosFrac;              // sub-microsecond remainder (Q16)
+    uint32_t lastPositionUs;                // micros() of the last position update
+    uint32_t sequencerCycle;                // loop count of the current pattern pass
+    uint32_t globalLoopMs;
+    SongEndCallback songEndCallback;
+
+    // tempo model: rate = tempo / songTempo in Q16.16
+    uint32_t songTempoCentiBpm;
+    uint32_t tempoCentiBpm;
+    uint32_t tempoRateQ16;
+
+    // MIDI clock output (see setClockOutput())
+    MidiSink *clockSink;
+    esp_timer_handle_t clockTimer;
+    volatile bool clockRunning;
+    uint32_t clockNextUs;                   // micros() of the next pulse
+    uint16_t clockFrac;                     // sub-microsecond remainder of the pulse period (Q16)
+    portMUX_TYPE clockLock = portMUX_INITIALIZER_UNLOCKED;   // guards the pulse state (timer task)
+
+    // live recording (see recordArm())
+    uint8_t recordTrack;                    // SEQ_NO_TRACK = not armed
+    uint8_t recordChannel;
+    Instrument recordInstrument;
+    uint32_t recordQuantizeMs;
+    uint32_t recordStartMs[128];            // pattern position of each held note
+    uint8_t recordVelocity[128];            // 0 = note not held
+
+    // arpeggiator (see arpEnable())
+    bool arpEnabled;
+    uint8_t arpChannel;
+    Instrument arpInstrument;
+    ArpMode arpMode;
+    uint8_t arpOctaves;
+    uint8_t arpStepsPerBeat;
+    uint8_t arpGatePercent;
+    uint8_t arpHeld[ARP_MAX_NOTES];         // held notes in the order they were pressed
+    uint8_t arpHeldVelocity[ARP_MAX_NOTES];
+    uint8_t arpSorted[ARP_MAX_NOTES];       // the same notes, lowest first
+    uint8_t arpHeldCount;
+    uint32_t arpStep;                       // steps played since the first key
+    uint32_t arpNextUs;                     // micros() of the next step
+    uint16_t arpNextFrac;                   // Q16 remainder of the step length
+    uint32_t arpRng;
+
+    // external clock (see setClockSource())
+    ClockSource clockSource;
+    uint32_t clockLockMs;
+    uint32_t clockDriftMs;
+    uint32_t extPeriodQ8;                   // estimated pulse period, us in Q24.8
+    uint32_t extLastPulseUs;
+    uint32_t extPredictUs;                  // when the PLL expects the next pulse
+    uint8_t extPredictFrac;                 // Q8 remainder of extPredictUs
+    uint32_t extPulses;                     // pulses since the PLL (re)acquired
+    uint32_t extPulseCount;                 // song position in pulses
+    bool extLocked;
+    uint8_t extTransport;                   // Start/Continue waiting for the next pulse (0 = none)
+
+    // scheduler hooks
+    EventFiredCallback eventFiredCallback;
+    LoopWrapCallback loopWrapCallback;
+    VoiceStolenCallback voiceStolenCallback;
+    LateCallback lateCallback;
+    SectionChangeCallback sectionChangeCallback;
+    uint32_t lateThresholdMs;
+
+    // automation lanes
+    AutomationLane lanes[SEQ_MAX_LANES];
+
+    // volume fades (0..15 = channels, FADE_MASTER = output) and cached volumes
+    Fade fades[FADE_MASTER + 1];
+    uint8_t activeFadeCount;
+    uint8_t channelVolume[16];              // last CC#7 sent per channel
+    uint8_t outputAttenuation;              // last SCI_VOL value (0.5 dB steps)
+
+    // alert priority layer
+    uint16_t alertChannelMask;
+    uint8_t alertReservedVoices;
+    uint8_t alertVoiceCount;                // sounding alert notes
+    AlertRequest alertQueue[SEQ_ALERT_QUEUE];
+    volatile uint8_t alertHead;             // written by requestAlert()
+    portMUX_TYPE alertLock = portMUX_INITIALIZER_UNLOCKED;   // serializes requestAlert() callers
+    volatile uint8_t alertTail;             // written by update()
+    uint8_t duckLevel;
+    uint32_t duckAttackMs;
+    uint32_t duckReleaseMs;
+    uint16_t duckedMask;                    // channels currently ducked
+    uint16_t usedChannelMask;               // channels that played a note (only those get ducked)
+    uint8_t duckSavedVolume[16];            // volume to restore after ducking
+
+    // deadline queue: binary min-heap on dueUs (wrap-safe compare)
+    ScheduledEvent scheduled[SEQ_MAX_SCHEDULED];
+    uint8_t scheduledCount;
+
+    // active voices
+    ActiveVoice voices[SEQ_MAX_VOICES];
+    uint8_t activeVoiceCount;
+    uint32_t nextVoiceOffMs;                // earliest pending noteOff (valid if activeVoiceCount > 0)
+
+    // last instrument per channel (0..15)
+    // used to avoid sending identical Program Change repeatedly
+    uint8_t lastChannelInstrument[16];
+
+    // MIDI output batching (see talkMIDI() / flushMIDI())
+    uint8_t txBuf[SEQ_TX_BUFFER];
+    uint8_t txLen;
+    uint8_t txBatchDepth;                   // > 0: keep collecting, flush at endBatch()
+    uint8_t runningStatus;                  // last channel status byte sent, 0 = none
+    MidiParser rawParser;                   // framing state of sendRaw() across calls
+    ChordVoicer chordVoicer;                // voice-leading state of playChordAsync(symbol)
+
+    // output destinations
+    bool vs1053Output;
+    MidiSink *sinks[SEQ_MAX_SINKS];
+    uint8_t sinkCount;
+
+    ////////////////// low level helpers //////////////////
+
+    /*
+      writeRegister(addr, high, low)
+      Low-level register write to VS1053 control interface.
+      Blocks until DREQ is asserted to ensure safe transfer.
+    */
+    void writeRegister(uint8_t addr, uint8_t high, uint8_t low) {
+        while (!digitalRead(VS1053_DREQ));
+        digitalWrite(VS1053_CS, LOW);
+        SPI.transfer(0x02);         // SCI write
+        SPI.transfer(addr);
+        SPI.transfer(high);
+        SPI.transfer(low);
+        digitalWrite(VS1053_CS, HIGH);
+    }
+
+    /*
+      loadPlugin()
+      Loads the minimal plugin data used for realtime MIDI operations.
+      Reads the plugin array from PROGMEM and writes to VS1053 registers.
+    */
+    void loadPlugin() {
+        for (int i = 0; i < 28; ) {
+            uint16_t addr = pgm_read_word(&vs1053_plugin[i++]);
+            uint16_t n    = pgm_read_word(&vs1053_plugin[i++]);
+            while (n--) {
+                uint16_t val = pgm_read_word(&vs1053_plugin[i++]);
+                writeRegister(addr, val >> 8, val & 0xFF);
+            }
+        }
+    }
+
+    /*
+      flushMIDI()
+      Sends the collected MIDI bytes to the VS1053's MIDI data interface.
+      In realtime MIDI mode every byte travels as a 16-bit SDI word (0x00, byte).
+      DREQ high guarantees room for 32 bytes, so the buffer goes out in chunks
+      of 16 MIDI bytes with a single DREQ wait and chip select per chunk,
+      instead of one per byte.
+    */
+    void flushMIDI() {
+        uint8_t i = 0;
+        while (i < txLen) {
+            uint8_t end = (txLen - i > 16) ? i + 16 : txLen;
+            while (!digitalRead(VS1053_DREQ));
+            digitalWrite(VS1053_DCS, LOW);
+            for (; i < end; i++) {
+                SPI.transfer(0x00);
+                SPI.transfer(txBuf[i]);
+            }
+            digitalWrite(VS1053_DCS, HIGH);
+        }
+        txLen = 0;
+        for (uint8_t s = 0; s < sinkCount; s++) sinks[s]->flush();
+    }
+
+    // collect MIDI bytes instead of sending them until the matching endBatch()
+    void beginBatch() { txBatchDepth++; }
+
+    void endBatch() {
+        if (txBatchDepth > 0 && --txBatchDepth == 0) flushMIDI();
+    }
+
+    // appends one byte, flushing first if the buffer is full
+    void queueMIDI(uint8_t data) {
+        if (txLen >= SEQ_TX_BUFFER) flushMIDI();
+        txBuf[txLen++] = data;
+    }
+
+    /*
+      talkMIDI(cmd, d1, d2)
+      Sends a MIDI message (cmd d1 d2). For Program Change (0xC0) and Channel
+      Pressure (0xD0), only cmd+d1 are sent. The status byte is left out when
+      it equals the previous one (running status). Outside a batch the message
+      is sent immediately; inside update() or playChordAsync() it is collected
+      and goes out with the rest of the burst.
+    */
+    void talkMIDI(uint8_t cmd, uint8_t d1, uint8_t d2 = 0) {
+        uint8_t type = cmd & 0xF0;
+        uint8_t len = (type == 0xC0 || type == 0xD0) ? 2 : 3;   // two-byte messages
+        if (vs1053Output) {
+            if (cmd != runningStatus) {
+                queueMIDI(cmd);
+                runningStatus = cmd;
+            }
+            queueMIDI(d1);
+            if (len == 3) queueMIDI(d2);
+        }
+        if (sinkCount > 0) {
+            uint8_t msg[3] = { cmd, d1, d2 };
+            for (uint8_t s = 0; s < sinkCount; s++) sinks[s]->write(msg, len);
+        }
+        if (txBatchDepth == 0) flushMIDI();
+    }
+
+    /*
+      sendSystem(msg, len)
+      Sends a system message (status >= 0xF0, SysEx included) as is. System
+      common messages and SysEx cancel running status; realtime bytes may be
+      interleaved anywhere and do not.
+    */
+    void sendSystem(const uint8_t *msg, size_t len) {
+        if (vs1053Output) {
+            for (size_t i = 0; i < len; i++) queueMIDI(msg[i]);
+            if (msg[0] < 0xF8) runningStatus = 0;
+        }
+        for (uint8_t s = 0; s < sinkCount; s++) sinks[s]->write(msg, len);
+        if (txBatchDepth == 0) flushMIDI();
+    }
+
+    /*
+      scheduleVoiceOffs(channel, notes, count, offTimeMs, track)
+      Registers the Note Offs of a whole chord in a single pass over the voice
+      table (one nextVoiceOffMs update). Voices are stolen for the notes that
+      do not fit before any note of the chord is placed, so the chord never
+      steals (and cuts) its own voices. Returns how many of the first notes
+      got a voice: fewer than count only when the chord is larger than the
+      voices the track may use.
+    */
+    uint8_t scheduleVoiceOffs(uint8_t channel, const uint8_t *notes, uint8_t count, uint32_t offTimeMs, uint8_t track) {
+        bool alert = (track == SEQ_ALERT_TRACK);
+        uint8_t limit = alert ? SEQ_MAX_VOICES : SEQ_MAX_VOICES - alertReservedVoices;
+        if (count > limit) count = limit;
+        for (;;) {
+            uint8_t used = alert ? activeVoiceCount : activeVoiceCount - alertVoiceCount;
+            uint8_t room = used < limit ? limit - used : 0;
+            if (SEQ_MAX_VOICES - activeVoiceCount < room) room = SEQ_MAX_VOICES - activeVoiceCount;
+            if (room >= count || stealVoice() < 0) break;
+        }
+        uint8_t used = alert ? activeVoiceCount : activeVoiceCount - alertVoiceCount;
+        uint8_t placed = 0;
+        for (int v = 0; v < SEQ_MAX_VOICES && placed < count && used < limit; v++) {
+            if (voices[v].active) continue;
+            ActiveVoice &vc = voices[v];
+            vc.active = true;
+            vc.channel = channel;
+            vc.note = notes[placed++];
+            vc.track = track;
+            vc.offTimeMs = offTimeMs;
+            used++;
+        }
+        if (placed > 0) {
+            if (activeVoiceCount == 0 || (int32_t)(offTimeMs - nextVoiceOffMs) < 0) nextVoiceOffMs = offTimeMs;
+            activeVoiceCount += placed;
+            if (alert) alertVoiceCount += placed;
+        }
+        return placed;
+    }
+
+    /*
+      dispatchEvent(track, ev, now)
+      Sends one sequencer event. Every event type goes through here, so CC,
+      bend, pressure, program and tempo events get the same timing as notes.
+      Notes of a track with a transpose or scale are looked up in its note map.
+    */
+    void dispatchEvent(uint8_t t, const SeqEvent &ev, uint32_t now) {
+        if (t < SEQ_MAX_TRACKS && ((noteMapMask >> t) & 1) && ev.channel != DRUM_CHANNEL && !((drumTrackMask >> t) & 1)) {
+            SeqEventType k = ev.kind();
+            if (k == SeqEventType::Note || k == SeqEventType::NoteOn || k == SeqEventType::NoteOff) {
+                SeqEvent mapped = ev;
+                mapped.note = (Note)noteMap[t][(uint8_t)ev.note & 0x7F];
+                sendEvent(t, mapped, now);
+                return;
+            }
+        }
+        sendEvent(t, ev, now);
+    }
+
+    // the body of dispatchEvent(): one switch over all event types
+    void sendEvent(uint8_t t, const SeqEvent &ev, uint32_t now) {
+        if (t < SEQ_MAX_TRACKS && trackMode[t] == TrackMode::Arranged) trackHeld(t, ev);
+        switch (ev.kind()) {
+            case SeqEventType::Note:
+                if (ev.channel == DRUM_CHANNEL || (t < SEQ_MAX_TRACKS && ((drumTrackMask >> t) & 1))) {
+                    playDrumHit((uint8_t)ev.note, ev.velocity);
+                    break;
+                }
+                // Use setInstrument() which internally avoids duplicate Program Change
+                setInstrument(ev.channel, ev.inst);
+                {
+                    int slot = claimVoice(t);
+                    noteOn(ev.channel, ev.note, ev.velocity);
+                    // track durations are song time; ad-hoc durations are real time
+                    occupyVoice(slot, ev.channel, (uint8_t)ev.note,
+                                now + (t < SEQ_MAX_TRACKS ? scaleDuration(ev.durationMs) : ev.durationMs), t);
+                }
+                break;
+            case SeqEventType::NoteOn:
+                noteOn(ev.channel, ev.note, ev.velocity);
+                break;
+            case SeqEventType::NoteOff:
+                noteOff(ev.channel, ev.note, ev.velocity);
+                break;
+            case SeqEventType::ControlChange:
+                sendControl(ev.channel, ev.controller, ev.value);
+                break;
+            case SeqEventType::PitchBend:
+                talkMIDI(0xE0 | ev.channel, ev.bendLsb, ev.bendMsb);
+                break;
+            case SeqEventType::ChannelPressure:
+                talkMIDI(0xD0 | ev.channel, ev.pressure);
+                break;
+            case SeqEventType::ProgramChange:
+                setInstrument(ev.channel, ev.program);
+                break;
+            case SeqEventType::Tempo:
+                tempoCentiBpm = ev.tempoCentiBpm;
+                updateTempoRate();
+                break;
+        }
+    }
+
+    void updateFeelMask(uint8_t track) {
+        bool on = (trackSwing[track] > 50 && trackSwingGridMs[track] > 0) || trackHumanizeMs[track] > 0 ||
+                  trackHumanizeVel[track] > 0 || trackGroove[track] != nullptr;
+        if (on) feelMask |= (1UL << track);
+        else feelMask &= ~(1UL << track);
+    }
+
+    /*
+      buildNoteMap(track)
+      Rebuilds the track's note table: transpose, clamp to 0..127, then the
+      nearest scale note (searching down first, then up).
+    */
+    void buildNoteMap(uint8_t track) {
+        uint16_t mask = trackScaleMask[track] & 0xFFF;
+        if (mask == 0) mask = 0xFFF;
+        if (trackTranspose[track] == 0 && mask == 0xFFF) {
+            noteMapMask &= ~(1UL << track);
+            return;
+        }
+        for (int n = 0; n < 128; n++) {
+            int m = constrain(n + trackTranspose[track], 0, 127);
+            for (int d = 0; d < 12; d++) {
+                if (m - d >= 0 && ((mask >> ((m - d - trackScaleRoot[track] + 120) % 12)) & 1)) { m -= d; break; }
+                if (m + d <= 127 && ((mask >> ((m + d - trackScaleRoot[track] + 120) % 12)) & 1)) { m += d; break; }
+            }
+            noteMap[track][n] = (uint8_t)m;
+        }
+        noteMapMask |= (1UL << track);
+    }
+
+    /*
+      playDrumHit(note, vel)
+      Drum voice policy: Note On on DRUM_CHANNEL and a Note Off through the
+      timestamp queue after drumReleaseMs. Hits never take a voice slot, so a
+      busy drum pattern cannot steal melodic notes.
+    */
+    void playDrumHit(uint8_t note, uint8_t vel) {
+        noteOn(DRUM_CHANNEL, (Note)note, vel);
+        SeqEvent off = makeEvent(SeqEventType::NoteOff, 0, DRUM_CHANNEL);
+        off.note = (Note)note;
+        if (drumReleaseMs == 0 || !scheduleEvent(micros() + drumReleaseMs * 1000, off, SEQ_NO_TRACK)) {
+            noteOff(DRUM_CHANNEL, (Note)note, 0);
+        }
+    }
+
+    /*
+      scheduleEvent(timeUs, ev, track) / dispatchScheduled(now)
+      Push an event into the deadline queue, and send every queued event whose
+      timestamp has passed, in timestamp order. Both are O(log n).
+    */
+    bool scheduleEvent(uint32_t timeUs, const SeqEvent &ev, uint8_t track) {
+        if (scheduledCount >= SEQ_MAX_SCHEDULED) {
+            if (debug) Serial.println("[SCHED] WARNING: queue full!");
+            return false;
+        }
+        // sift up
+        uint8_t i = scheduledCount++;
+        while (i > 0) {
+            uint8_t parent = (i - 1) / 2;
+            if ((int32_t)(timeUs - scheduled[parent].dueUs) >= 0) break;
+            scheduled[i] = scheduled[parent];
+            i = parent;
+        }
+        scheduled[i].ev = ev;
+        scheduled[i].dueUs = timeUs;
+        scheduled[i].track = track;
+        return true;
+    }
+
+    void dispatchScheduled(uint32_t now) {
+        uint32_t nowUs = micros();
+        while (scheduledCount > 0 && (int32_t)(nowUs - scheduled[0].dueUs) >= 0) {
+            ScheduledEvent top = scheduled[0];
+            // move the last entry to the root and sift it down
+            --scheduledCount;
+            if (scheduledCount > 0) siftDown(0, scheduled[scheduledCount]);
+            if (alertHead != alertTail) serviceAlerts();
+            dispatchEvent(top.track, top.ev, now);
+        }
+    }
+
+    // places entry at heap index i or below, keeping the min-heap order
+    void siftDown(uint8_t i, ScheduledEvent entry) {
+        for (;;) {
+            uint8_t child = 2 * i + 1;
+            if (child >= scheduledCount) break;
+            if (child + 1 < scheduledCount && (int32_t)(scheduled[child + 1].dueUs - scheduled[child].dueUs) < 0) child++;
+            if ((int32_t)(scheduled[child].dueUs - entry.dueUs) >= 0) break;
+            scheduled[i] = scheduled[child];
+            i = child;
+        }
+        scheduled[i] = entry;
+    }
+
+    /*
+      dropTrackScheduled()
+      Removes the queued events of sequencer tracks (swung/humanized notes,
+      ratchets) and rebuilds the heap; the *At() events stay.
+    */
+    void dropTrackScheduled() {
+        uint8_t kept = 0;
+        for (uint8_t i = 0; i < scheduledCount; i++) {
+            if (scheduled[i].track >= SEQ_MAX_TRACKS) scheduled[kept++] = scheduled[i];
+        }
+        scheduledCount = kept;
+        for (int i = kept / 2 - 1; i >= 0; i--) siftDown((uint8_t)i, scheduled[i]);
+    }
+
+    // true while a sequencer track still has events in the timestamp queue
+    bool hasTrackScheduled() const {
+        for (uint8_t i = 0; i < scheduledCount; i++) {
+            if (scheduled[i].track < SEQ_MAX_TRACKS) return true;
+        }
+        return false;
+    }
+
+    /*
+      playTrackEvents(track, upToMs, posMs, now)
+      Plays all pending events of a track whose timeOffset <= upToMs and moves
+      the track cursor past them. posMs is the actual playback position in the
+      same time frame as upToMs, used to measure how late an event is.
+    */
+    void playTrackEvents(int t, uint32_t upToMs, uint32_t posMs, uint32_t now) {
+        if (trackMode[t] == TrackMode::Grid) { playGridSteps(t, upToMs, posMs, now); return; }
+        if (trackMode[t] == TrackMode::Generator) { playGeneratorSteps(t, upToMs, posMs, now); return; }
+        if (trackMode[t] == TrackMode::Arranged) { playArrangedEvents(t, upToMs, posMs, now); return; }
+        uint32_t ahead = feelLookaheadMs(t);
+        while (trackCursor[t] < trackEventCount[t]) {
+            SeqEvent &ev = tracks[t].events[trackCursor[t]];
+            if (ev.timeOffsetMs > upToMs + ahead) break;
+            if (debug) Serial.printf("[SEQ] tr=%d ev=%d type=%d ch=%d @%d\n",
+                                     t, trackCursor[t], ev.type, ev.channel, posMs);
+            trackCursor[t]++;
+            playEvent((uint8_t)t, ev, posMs, now);
+        }
+    }
+
+    /*
+      playArrangedEvents(t, upToMs, posMs, now)
+      playTrackEvents() for an arranged track: walks entry -> repeat -> pattern
+      event, and plays a copy of each event moved to its place in the track
+      (and transposed).
+    */
+    void playArrangedEvents(int t, uint32_t upToMs, uint32_t posMs, uint32_t now) {
+        Arrangement &a = tracks[t].arrangement;
+        uint32_t ahead = feelLookaheadMs(t);
+        bool transposable = !((drumTrackMask >> t) & 1);
+        while (a.entry < a.entryCount) {
+            const ArrangeEntry &e = a.entries[a.entry];
+            const Pattern &p = song->patterns[e.pattern];
+            if (trackCursor[t] >= p.eventCount) {
+                // end of this repeat: next repeat or next entry
+                trackCursor[t] = 0;
+                if (++a.repeat >= e.repeat) {
+                    a.repeat = 0;
+                    a.entry++;
+                }
+                continue;
+            }
+            SeqEvent ev = p.events[trackCursor[t]];
+            ev.timeOffsetMs += e.startMs + a.repeat * p.lengthMs;
+            if (ev.timeOffsetMs > upToMs + ahead || ev.timeOffsetMs >= a.endMs) break;
+            SeqEventType k = ev.kind();
+            if (e.transpose != 0 && transposable && ev.channel != DRUM_CHANNEL &&
+                (k == SeqEventType::Note || k == SeqEventType::NoteOn || k == SeqEventType::NoteOff)) {
+                ev.note = (Note)constrain((int)ev.note + e.transpose, 0, 127);
+            }
+            if (debug) Serial.printf("[SEQ] tr=%d pat=%d ev=%d type=%d @%d\n",
+                                     t, e.pattern, trackCursor[t], ev.type, posMs);
+            trackCursor[t]++;
+            playEvent((uint8_t)t, ev, posMs, now);
+        }
+    }
+
+    /*
+      seekArrangement(t, posMs)
+      Moves an arranged track to the first event at or after posMs; returns
+      the event index inside the pattern (for trackCursor).
+    */
+    uint16_t seekArrangement(int t, uint32_t posMs) {
+        Arrangement &a = tracks[t].arrangement;
+        a.repeat = 0;
+        for (a.entry = 0; a.entry < a.entryCount; a.entry++) {
+            const ArrangeEntry &e = a.entries[a.entry];
+            const Pattern &p = song->patterns[e.pattern];
+            if (p.eventCount == 0 || p.lengthMs == 0) continue;
+            if (posMs <= e.startMs) return 0;
+            uint32_t into = posMs - e.startMs;
+            uint32_t repeat = into / p.lengthMs;
+            if (repeat >= e.repeat) continue;
+            a.repeat = (uint16_t)repeat;
+            uint32_t inPattern = into % p.lengthMs;
+            uint16_t i = 0;
+            while (i < p.eventCount && p.events[i].timeOffsetMs < inPattern) i++;
+            return i;   // may equal eventCount: playback moves on to the next repeat
+        }
+        return 0;
+    }
+
+    void updateArrangementLengths(const SongSlot *changed) {
+        if (changed != song) return;   // only the played slot is arranged
+        for (uint8_t t = 0; t < SEQ_MAX_TRACKS; t++) {
+            if (trackMode[t] == TrackMode::Arranged) updateArrangementLength(t);
+        }
+    }
+
+    // track length of an arranged track: end of its last entry
+    void updateArrangementLength(uint8_t t) {
+        const Arrangement &a = tracks[t].arrangement;
+        uint32_t end = 0;
+        for (uint8_t i = 0; i < a.entryCount; i++) {
+            const ArrangeEntry &e = a.entries[i];
+            uint32_t entryEnd = e.startMs + e.repeat * song->patterns[e.pattern].lengthMs;
+            if (entryEnd > end) end = entryEnd;
+        }
+        trackLoopLengthMs[t] = end;
+    }
+
+    /*
+      playEvent(t, ev, posMs, now)
+      Sends one track event at position posMs, or queues it when the track's
+      feel (swing, humanize) moves it after posMs, then calls the hooks.
+      Returns the delay in us given to the event (0 = sent now).
+    */
+    uint32_t playEvent(uint8_t t, const SeqEvent &ev, uint32_t posMs, uint32_t now) {
+        if (alertHead != alertTail) serviceAlerts();   // alerts cut into a burst
+        uint32_t delayUs = 0;
+        if ((feelMask >> t) & 1) {
+            SeqEvent out = ev;
+            int32_t eff = (int32_t)ev.timeOffsetMs + applyFeel(t, out);
+            int32_t wait = eff - (int32_t)posMs;
+            if (wait > 0) delayUs = scaleDuration((uint32_t)wait) * 1000;
+            if (delayUs == 0 || !scheduleEvent(micros() + delayUs, out, t)) {
+                delayUs = 0;
+                dispatchEvent(t, out, now);
+            }
+        } else {
+            dispatchEvent(t, ev, now);
+        }
+        if (eventFiredCallback) eventFiredCallback(t, ev);
+        if (lateCallback && posMs > ev.timeOffsetMs && posMs - ev.timeOffsetMs > lateThresholdMs) {
+            lateCallback(t, ev, posMs - ev.timeOffsetMs);
+        }
+        return delayUs;
+    }
+
+    /*
+      applyFeel(t, ev)
+      Swing, groove and humanize of track t for one event: returns its timing
+      offset in ms (song time, never before the loop start) and adjusts its
+      velocity. Swing delays the notes on every second subdivision of the
+      swing grid, a groove moves each note by the offset of its step and
+      humanize adds seeded random offsets. Only Note events are moved (their
+      off time follows their start): a NoteOn and its NoteOff may fall on
+      different steps, and moving them apart could put the off first.
+    */
+    int32_t applyFeel(uint8_t t, SeqEvent &ev) {
+        int32_t offset = 0;
+        SeqEventType k = ev.kind();
+        uint32_t grid = trackSwingGridMs[t];
+        if (k == SeqEventType::Note && trackSwing[t] > 50 && grid > 0 && ((ev.timeOffsetMs / grid) & 1)) {
+            offset += (int32_t)(grid * (trackSwing[t] - 50) * 2 / 100);
+        }
+        const Groove *gr = trackGroove[t];
+        if (gr != nullptr) {
+            uint8_t step = ((ev.timeOffsetMs + gr->gridMs / 2) / gr->gridMs) % gr->steps;
+            if (k == SeqEventType::Note) offset += gr->timingMs[step] * trackGrooveAmount[t] / 100;
+            if ((k == SeqEventType::Note || k == SeqEventType::NoteOn) && ev.velocity > 0) {
+                int v = ev.velocity + gr->velocity[step] * trackGrooveAmount[t] / 100;
+                ev.velocity = constrain(v, 1, 127);
+            }
+        }
+        if (k == SeqEventType::Note && trackHumanizeMs[t] > 0) {
+            offset += (int32_t)(xorshift32(trackHumanizeRng[t]) % (2 * trackHumanizeMs[t] + 1)) - trackHumanizeMs[t];
+        }
+        if ((k == SeqEventType::Note || k == SeqEventType::NoteOn) && trackHumanizeVel[t] > 0 && ev.velocity > 0) {
+            int v = ev.velocity + (int)(xorshift32(trackHumanizeRng[t]) % (2 * trackHumanizeVel[t] + 1)) - trackHumanizeVel[t];
+            ev.velocity = constrain(v, 1, 127);
+        }
+        if ((int32_t)ev.timeOffsetMs + offset < 0) offset = -(int32_t)ev.timeOffsetMs;
+        return offset;
+    }
+
+    // how far ahead events of track t must be read so early (humanized) ones are not late
+    uint32_t feelLookaheadMs(int t) const {
+        return ((feelMask >> t) & 1) ? trackHumanizeMs[t] + trackGrooveEarlyMs[t] : 0;
+    }
+
+    /*
+      playGridSteps(t, upToMs, posMs, now)
+      playTrackEvents() for a grid track: the cursor is the next step, and the
+      lanes hitting on a step are walked with count-trailing-zeros, so empty
+      lanes cost nothing. Each hit is sent as a note event.
+    */
+    void playGridSteps(int t, uint32_t upToMs, uint32_t posMs, uint32_t now) {
+        const GridTrack &g = tracks[t].grid;
+        uint32_t ahead = feelLookaheadMs(t);
+        while (trackCursor[t] < g.steps) {
+            uint8_t step = (uint8_t)trackCursor[t];
+            uint32_t stepTime = step * g.stepMs;
+            if (stepTime > upToMs + ahead) break;
+            trackCursor[t]++;
+            bool accent = (g.accentSteps >> step) & 1;
+            uint32_t hits = g.stepLanes[step];
+            while (hits) {
+                uint8_t lane = __builtin_ctz(hits);
+                hits &= hits - 1;
+                SeqEvent ev = makeEvent(SeqEventType::Note, stepTime, g.channel);
+                ev.inst = g.inst;
+                ev.note = (Note)g.laneNote[lane];
+                ev.velocity = accent ? g.accentVelocity : g.laneVelocity[lane];
+                ev.durationMs = g.gateMs;
+                if (debug) Serial.printf("[SEQ] tr=%d step=%d lane=%d @%d\n", t, step, lane, posMs);
+                playEvent((uint8_t)t, ev, posMs, now);
+            }
+        }
+    }
+
+    /*
+      playGeneratorSteps(t, upToMs, posMs, now)
+      playTrackEvents() for a generator track: decides each step as it is
+      reached. Ratchet repeats go through the timestamp queue.
+    */
+    void playGeneratorSteps(int t, uint32_t upToMs, uint32_t posMs, uint32_t now) {
+        GeneratorTrack &g = tracks[t].generator;
+        uint32_t ahead = feelLookaheadMs(t);
+        while (trackCursor[t] < g.steps) {
+            uint8_t step = (uint8_t)trackCursor[t];
+            uint32_t stepTime = step * g.stepMs;
+            if (stepTime > upToMs + ahead) break;
+            trackCursor[t]++;
+            // Euclidean pulse: k hits over n steps (Bresenham)
+            if ((uint16_t)((step + g.rotation) % g.steps) * g.pulses % g.steps >= g.pulses) continue;
+            if (g.probability < 100 && xorshift32(g.rng) % 100 >= g.probability) continue;
+            SeqEvent ev = makeEvent(SeqEventType::Note, stepTime, g.channel);
+            ev.inst = g.inst;
+            ev.note = (Note)g.note;
+            ev.velocity = g.velocity;
+            uint8_t hits = (g.ratchetChance > 0 && xorshift32(g.rng) % 100 < g.ratchetChance) ? g.ratchetCount : 1;
+            ev.durationMs = hits > 1 ? g.stepMs / (2 * hits) + 1 : g.gateMs;
+            if (debug) Serial.printf("[SEQ] tr=%d gen step=%d x%d @%d\n", t, step, hits, posMs);
+            uint32_t delayUs = playEvent((uint8_t)t, ev, posMs, now);
+            if (hits > 1) {
+                // repeats follow the (possibly swung) first hit
+                uint32_t subUs = scaleDuration(g.stepMs) * 1000 / hits;
+                uint32_t startUs = micros() + delayUs;
+                for (uint8_t r = 1; r < hits; r++) scheduleEvent(startUs + r * subUs, ev, (uint8_t)t);
+            }
+        }
+    }
+
+    static uint32_t xorshift32(uint32_t &x) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return x;
+    }
+
+    // events (grid/generator: steps) of a track, i.e. the end value of its cursor
+    uint16_t trackLength(int t) const {
+        if (trackMode[t] == TrackMode::Grid) return tracks[t].grid.steps;
+        if (trackMode[t] == TrackMode::Generator) return tracks[t].generator.steps;
+        return trackEventCount[t];
+    }
+
+    // step length of a grid or generator track (0 for event tracks)
+    uint32_t trackStepMs(int t) const {
+        if (trackMode[t] == TrackMode::Grid) return tracks[t].grid.stepMs;
+        if (trackMode[t] == TrackMode::Generator) return tracks[t].generator.stepMs;
+        return 0;
+    }
+
+    bool isEventTrack(int t) const { return trackMode[t] == TrackMode::Events; }
+
+    // true once a one-shot playback has played every event of track t
+    bool trackFinished(int t) const {
+        if (trackMode[t] == TrackMode::Arranged) return tracks[t].arrangement.entry >= tracks[t].arrangement.entryCount;
+        return trackCursor[t] >= trackLength(t);
+    }
+
+    // points track t at its first event (and an arranged track at its first entry)
+    void rewindTrack(int t) {
+        trackCursor[t] = 0;
+        if (trackMode[t] == TrackMode::Arranged) {
+            tracks[t].arrangement.entry = 0;
+            tracks[t].arrangement.repeat = 0;
+        }
+    }
+
+    /*
+      updateAutomation(posMs, now)
+      Interpolates every lane at the current track position and sends the
+      value if it changed and the lane's rate limit allows it.
+      Returns true while a lane still has breakpoints ahead of posMs.
+    */
+    bool updateAutomation(uint32_t posMs, uint32_t now) {
+        bool pending = false;
+        for (int l = 0; l < SEQ_MAX_LANES; l++) {
+            AutomationLane &ln = lanes[l];
+            if (!ln.used || ln.pointCount == 0) continue;
+            if (posMs < ln.points[ln.pointCount - 1].timeOffsetMs) pending = true;
+            if (posMs < ln.points[0].timeOffsetMs) continue;   // lane not started yet
+            if (ln.lastValue != LANE_NO_VALUE && now - ln.lastSentMs < ln.minIntervalMs) continue;
+
+            // move the segment cursor (rewound on loop wrap)
+            while (ln.segment + 1 < ln.pointCount && ln.points[ln.segment + 1].timeOffsetMs <= posMs) ln.segment++;
+
+            int16_t value = interpolateLane(ln, posMs);
+            if (value == ln.lastValue) continue;
+            ln.lastValue = value;
+            ln.lastSentMs = now;
+            if (ln.target == AUTOMATION_PITCH_BEND) {
+                uint16_t v = bendToRaw(value);
+                talkMIDI(0xE0 | ln.channel, v & 0x7F, (v >> 7) & 0x7F);
+            } else {
+                sendControl(ln.channel, ln.target, (uint8_t)value);
+            }
+        }
+        return pending;
+    }
+
+    /*
+      interpolateLane(lane, posMs)
+      Value of a lane at posMs, inside its current segment (fixed-point, no floats).
+    */
+    static int16_t interpolateLane(const AutomationLane &ln, uint32_t posMs) {
+        const AutomationPoint &a = ln.points[ln.segment];
+        if (ln.segment + 1 >= ln.pointCount || a.curve == Curve::Step) return a.value;
+        const AutomationPoint &b = ln.points[ln.segment + 1];
+        uint32_t span = b.timeOffsetMs - a.timeOffsetMs;
+        if (span == 0) return b.value;
+        uint32_t f = shapeCurve((uint32_t)(((uint64_t)(posMs - a.timeOffsetMs) << 16) / span), a.curve);
+        int32_t delta = (int32_t)b.value - (int32_t)a.value;
+        return (int16_t)(a.value + (((int64_t)delta * (int32_t)f) >> 16));
+    }
+
+    /*
+      shapeCurve(f, curve)
+      Maps a linear progress f (Q16, 0..65536) through a curve shape.
+    */
+    static uint32_t shapeCurve(uint32_t f, Curve curve) {
+        if (f > 0x10000) f = 0x10000;
+        switch (curve) {
+            case Curve::Step: return 0;
+            // squares in 64 bits: 0x10000 * 0x10000 does not fit 32
+            case Curve::Exponential: return (uint32_t)(((uint64_t)f * f) >> 16);
+            case Curve::Logarithmic: { uint64_t r = 0x10000 - f; return 0x10000 - (uint32_t)((r * r) >> 16); }
+            default: return f;
+        }
+    }
+
+    /*
+      updateFades(now)
+      Advances running fades. Output is deduplicated against the cached volume,
+      so a slow fade sends one message per actual step, not one per update().
+    */
+    void updateFades(uint32_t now) {
+        for (int i = 0; i <= FADE_MASTER; i++) {
+            Fade &f = fades[i];
+            if (!f.active) continue;
+            uint32_t elapsed = now - f.startMs;
+            uint8_t value = f.to;
+            if (elapsed < f.durationMs) {
+                uint32_t p = shapeCurve((uint32_t)(((uint64_t)elapsed << 16) / f.durationMs), f.curve);
+                value = (uint8_t)(f.from + ((((int32_t)f.to - (int32_t)f.from) * (int32_t)p) >> 16));
+            }
+            if (i == FADE_MASTER) {
+                if (value != outputAttenuation) writeOutputAttenuation(value);
+            } else if (value != channelVolume[i]) {
+                writeChannelVolume(i, value);
+            }
+            if (elapsed >= f.durationMs) {
+                f.active = false;
+                activeFadeCount--;
+                if (debug) Serial.printf("[FADE] ch=%d done\n", i);
+            }
+        }
+    }
+
+    void cancelFade(uint8_t slot) {
+        if (!fades[slot].active) return;
+        fades[slot].active = false;
+        activeFadeCount--;
+    }
+
+    /*
+      sendControl(channel, controller, value)
+      Sends a CC and keeps the CC#7 cache in sync (used by fades to skip
+      redundant messages). CC#7 on a ducked channel is saved for the restore
+      and sent scaled by the duck level.
+    */
+    void sendControl(uint8_t channel, uint8_t controller, uint8_t value) {
+        if (controller == 7) {
+            if (duckedMask & (1 << channel)) {
+                duckSavedVolume[channel] = value;
+                cancelFade(channel);
+                value = (uint8_t)((value * duckLevel) / 127);
+            }
+            writeChannelVolume(channel, value);
+            return;
+        }
+        talkMIDI(0xB0 | channel, controller, value);
+    }
+
+    // sends CC#7 as is and caches it
+    void writeChannelVolume(uint8_t channel, uint8_t value) {
+        talkMIDI(0xB0 | channel, 7, value);
+        channelVolume[channel] = value;
+    }
+
+    // writes SCI_VOL with the same attenuation on both sides (0.5 dB steps, 0xFE = silence)
+    void writeOutputAttenuation(uint8_t att) {
+        if (att > 0xFE) att = 0xFE;
+        writeRegister(0x0B, att, att);
+        outputAttenuation = att;
+    }
+
+    /*
+      scheduleVoiceOff(channel, note, offTimeMs, track)
+      Finds a voice slot (see claimVoice()) and schedules when to send Note Off
+      for that note.
     */
-    void playNoteAsync(uint8_t channel, Note note, uint32_t durationMs, uint8_t vel = 110) {
-        noteOn(channel, note, vel);
-        scheduleVoiceOff(channel, (uint8_t)note, millis() + durationMs);
-        if (debug) Serial.printf("[MIDI] playNoteAsync ch=%d note=%d dur=%d\n", channel, (uint8_t)note, durationMs);
+    void scheduleVoiceOff(uint8_t channel, uint8_t note, uint32_t offTimeMs, uint8_t track) {
+        occupyVoice(claimVoice(track), channel, note, offTimeMs, track);
     }
 
-    // ------------------- Sequencer API -------------------
-
     /*
-      clearTrack(track)
-      Remove all events from a specified track.
+      claimVoice(track)
+      Returns a free voice slot for a new note of track. Background notes may
+      not use the slots reserved for alerts. If no slot is available, the voice
+      that would end soonest is stolen (an alert steals background voices
+      first): its Note Off is sent right away and onVoiceStolen() is notified.
+      Call it before sending the new Note On, so stealing the same channel and
+      note does not cut the new note; then fill the slot with occupyVoice().
     */
-    void clearTrack(uint8_t track) {
-        if (track >= SEQ_MAX_TRACKS) return;
-        trackEventCount[track] = 0;
-        trackLoopLengthMs[track] = 0;
+    int claimVoice(uint8_t track) {
+        bool alert = (track == SEQ_ALERT_TRACK);
+        bool full = alert ? activeVoiceCount >= SEQ_MAX_VOICES
+                          : activeVoiceCount - alertVoiceCount >= SEQ_MAX_VOICES - alertReservedVoices;
+        int slot = -1;
+        if (!full) {
+            for (int v = 0; v < SEQ_MAX_VOICES; v++) {
+                if (!voices[v].active) { slot = v; break; }
+            }
+        }
+        if (slot < 0) slot = stealVoice();
+        return slot;
+    }
+
+    // no free voice slot: frees the background voice closest to its release
+    // (an alert voice when only alerts are left) and returns it, -1 if none
+    int stealVoice() {
+        int slot = findVoiceToSteal(false);
+        if (slot < 0) slot = findVoiceToSteal(true);
+        if (slot < 0) return -1;
+        ActiveVoice &old = voices[slot];
+        noteOff(old.channel, (Note)old.note);
+        releaseVoice(old);
+        if (debug) Serial.printf("[VOICE] WARNING: no free voice slots, stole ch=%d note=%d\n", old.channel, old.note);
+        if (voiceStolenCallback) voiceStolenCallback(old.channel, old.note, old.track);
+        return slot;
+    }
+
+    // registers the note played in a slot returned by claimVoice()
+    void occupyVoice(int slot, uint8_t channel, uint8_t note, uint32_t offTimeMs, uint8_t track) {
+        bool alert = (track == SEQ_ALERT_TRACK);
+        ActiveVoice &vc = voices[slot];
+        vc.active = true;
+        vc.channel = channel;
+        vc.note = note;
+        vc.track = track;
+        vc.offTimeMs = offTimeMs;
+        if (activeVoiceCount == 0 || (int32_t)(offTimeMs - nextVoiceOffMs) < 0) nextVoiceOffMs = offTimeMs;
+        activeVoiceCount++;
+        if (alert) alertVoiceCount++;
+        if (debug) Serial.printf("[VOICE] scheduled off ch=%d note=%d at %u\n", channel, note, offTimeMs);
+    }
+
+    // earliest-ending voice that is (alerts == true) or is not an alert voice, -1 if none
+    int findVoiceToSteal(bool alerts) const {
+        int slot = -1;
+        for (int v = 0; v < SEQ_MAX_VOICES; v++) {
+            if (!voices[v].active || (voices[v].track == SEQ_ALERT_TRACK) != alerts) continue;
+            if (slot < 0 || (int32_t)(voices[v].offTimeMs - voices[slot].offTimeMs) < 0) slot = v;
+        }
+        return slot;
     }
 
     /*
-      addEvent(track, timeOffsetMs, channel, inst, note, vel, durationMs)
-      Add an event to the specified track. Returns true on success.
-      timeOffsetMs is relative to track start (in milliseconds).
+      releaseVoice(voice)
+      Frees a voice slot (the Note Off has been sent). When the last alert note
+      goes away, the ducked background is faded back.
     */
-    bool addEvent(uint8_t track, uint32_t timeOffsetMs, uint8_t channel, Instrument inst, Note note, uint8_t vel, uint32_t durationMs) {
-        if (track >= SEQ_MAX_TRACKS) return false;
-        if (trackEventCount[track] >= SEQ_MAX_EVENTS) return false;
-        SeqEvent &e = tracks[track][trackEventCount[track]++];
-        e.timeOffsetMs = timeOffsetMs;
-        e.channel = channel;
-        e.inst = inst;
-        e.note = note;
-        e.velocity = vel;
-        e.durationMs = durationMs;
-        e.played = false;
-        if (timeOffsetMs + durationMs > trackLoopLengthMs[track]) trackLoopLengthMs[track] = timeOffsetMs + durationMs;
-        if (debug) Serial.printf("[SEQ] addEvent tr=%d t=%d ch=%d inst=%d note=%d vel=%d dur=%d\n", (int)track, (int)timeOffsetMs, (int)channel, (int)inst, (int)note, (int)vel, (int)durationMs);
-        return true;
+    void releaseVoice(ActiveVoice &vc) {
+        vc.active = false;
+        activeVoiceCount--;
+        if (vc.track == SEQ_ALERT_TRACK && --alertVoiceCount == 0) restoreDucking();
     }
 
     /*
-      setPan(channel, pan)
-      Send Control Change #10 (Pan) for given channel. pan: 0..127
+      releaseDueVoices(now)
+      Sends Note Off for every voice whose time has come and recomputes the
+      earliest pending noteOff for the next update().
     */
-    void setPan(uint8_t channel, uint8_t pan) {
-        if (pan > 127) {
-            if (debug) Serial.println("[MIDI] Warning: Pan value too high! Clamping to 127.");
-            pan = 127;
+    void releaseDueVoices(uint32_t now) {
+        bool haveNext = false;
+        for (int v = 0; v < SEQ_MAX_VOICES; v++) {
+            if (!voices[v].active) continue;
+            if ((int32_t)(now - voices[v].offTimeMs) >= 0) {
+                noteOff(voices[v].channel, (Note)voices[v].note);
+                releaseVoice(voices[v]);
+            } else if (!haveNext || (int32_t)(voices[v].offTimeMs - nextVoiceOffMs) < 0) {
+                nextVoiceOffMs = voices[v].offTimeMs;
+                haveNext = true;
+            }
         }
-    
-        talkMIDI(0xB0 | (channel & 0x0F), 10, pan); // CC#10 = Pan
-        if (debug) Serial.printf("[MIDI] setPan ch=%d pan=%d\n", channel, pan);
     }
 
     /*
-      setBassBoost(bass)
-      Small helper to write to VS1053 register to increase bass.
-      bass: 0..15
+      serviceAlerts()
+      Plays the alerts queued by requestAlert().
     */
-    void setBassBoost(uint8_t bass) {
-        if (bass > 15) {
-            if (debug) Serial.println("[MIDI] Warning: Bass boost value too high! Clamping to 15.");
-            bass = 15;
+    void serviceAlerts() {
+        while (alertTail != alertHead) {
+            AlertRequest r = alertQueue[alertTail];
+            alertTail = (alertTail + 1) % SEQ_ALERT_QUEUE;
+            playAlert(r.channel, r.inst, r.note, r.durationMs, r.velocity);
         }
-        writeRegister(0x02, (bass & 0x0F) << 4, 0x00);
-        if (debug) Serial.printf("[MIDI] setBassBoost=%d\n", bass);
     }
 
     /*
-      setReverb(reverb)
-      Send CC#91 (Reverb Send). value: 0..127
+      duckBackground() / restoreDucking()
+      Fade non-alert channels down to duckLevel of their cached volume, and back.
+      While a channel is ducked, CC#7 sent to it is remembered as the volume to
+      restore and scaled down on the way out (see sendControl()).
     */
-    void setReverb(uint8_t reverb) {
-        if (reverb > 127) {
-            if (debug) Serial.println("[MIDI] Warning: Reverb value too high! Clamping to 127.");
-            reverb = 127;
+    void duckBackground() {
+        if (duckLevel >= 127) return;
+        uint16_t mask = usedChannelMask & (uint16_t)~alertChannelMask & (uint16_t)~duckedMask;
+        for (uint8_t ch = 0; ch < 16; ch++) {
+            if (!(mask & (1 << ch))) continue;
+            duckSavedVolume[ch] = channelVolume[ch];
+            fadeTo(ch, (uint8_t)((channelVolume[ch] * duckLevel) / 127), duckAttackMs);
         }
-        talkMIDI(0xB0, 91, reverb); // CC#91 = Reverb Send
-        if (debug) Serial.printf("[MIDI] setReverb=%d\n", reverb);
+        duckedMask |= mask;
     }
 
-    /*
-      setMasterVolume(volume)
-      Send CC#7 (Master Volume). value: 0..127
-    */
-    void setMasterVolume(uint8_t volume) {
-        if (volume > 127) {
-            if (debug) Serial.println("[MIDI] Warning: Master volume value too high! Clamping to 127.");
-            volume = 127;
+    void restoreDucking() {
+        uint16_t mask = duckedMask;
+        duckedMask = 0;
+        for (uint8_t ch = 0; ch < 16; ch++) {
+            if (mask & (1 << ch)) fadeTo(ch, duckSavedVolume[ch], duckReleaseMs);
         }
-    
-        talkMIDI(0xB0, 7, volume); // CC#7 = Master Volume
-        if (debug) Serial.printf("[MIDI] setMasterVolume=%d\n", volume);
     }
 
     /*
-      setChannelVolume(channel, volume)
-      Send CC#7 on a specific channel (Channel Volume).
+      hasSequencerVoices()
+      True while a note started by the sequencer is still waiting for its noteOff.
     */
-    void setChannelVolume(uint8_t channel, uint8_t volume) {
-        if (volume > 127) {
-            if (debug) Serial.println("[MIDI] Warning: Channel volume value too high! Clamping to 127.");
-            volume = 127;
+    bool hasSequencerVoices() const {
+        if (activeVoiceCount == 0) return false;
+        for (int v = 0; v < SEQ_MAX_VOICES; v++) {
+            if (voices[v].active && voices[v].track < SEQ_MAX_TRACKS) return true;
         }
-    
-        talkMIDI(0xB0 | (channel & 0x0F), 7, volume);
-        if (debug) Serial.printf("[MIDI] setChannelVolume ch=%d vol=%d\n", channel, volume);
+        return false;
     }
 
     /*
-      startSequencer(loopMs)
-      Starts the sequencer. If loopMs == 0, loop length is computed automatically
-      as the longest track length. Otherwise, the whole pattern loops every loopMs.
+      makeEvent(type, timeOffsetMs, channel) / insertEvent(track, e)
+      Build an event header and insert an event into a track, keeping the track
+      sorted by time. Events go after existing events with the same time.
     */
-    void startSequencer(uint32_t loopMs = 0) {
-        sequencerStartMs = millis();
-        sequencerRunning = true;
-        globalLoopMs = loopMs;
-        // reset played flags for a fresh start
-        for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
-            for (int i = 0; i < trackEventCount[t]; i++) tracks[t][i].played = false;
+    static SeqEvent makeEvent(SeqEventType type, uint32_t timeOffsetMs, uint8_t channel) {
+        SeqEvent e;
+        memset(&e, 0, sizeof(e));
+        e.timeOffsetMs = timeOffsetMs;
+        e.channel = channel & 0x0F;
+        e.type = (uint8_t)type;
+        return e;
+    }
+
+    bool insertEvent(uint8_t track, const SeqEvent &e, uint16_t *index = nullptr) {
+        if (track >= SEQ_MAX_TRACKS || !isEventTrack(track) || inSongLoader()) return false;
+        if (trackEventCount[track] >= SEQ_MAX_EVENTS) return false;
+        uint16_t pos = trackEventCount[track];
+        while (pos > 0 && tracks[track].events[pos - 1].timeOffsetMs > e.timeOffsetMs) {
+            tracks[track].events[pos] = tracks[track].events[pos - 1];
+            pos--;
         }
-        if (debug) Serial.println("[SEQ] started");
+        trackEventCount[track]++;
+        // keep the play cursor on the same pending event if we inserted before it
+        if (pos < trackCursor[track]) trackCursor[track]++;
+        tracks[track].events[pos] = e;
+        if (index) *index = pos;
+        uint32_t end = e.timeOffsetMs + (e.kind() == SeqEventType::Note ? e.durationMs : 0);
+        if (end > trackLoopLengthMs[track]) trackLoopLengthMs[track] = end;
+        return true;
+    }
+
+    ////////////////// tempo helpers //////////////////
+
+    static uint32_t bpmToCenti(float bpm) {
+        if (bpm < 1.0f) bpm = 1.0f;
+        return (uint32_t)(bpm * 100.0f + 0.5f);
+    }
+
+    static uint16_t bendToRaw(int16_t bend) {
+        if (bend < -8192) bend = -8192;
+        if (bend > 8191) bend = 8191;
+        return (uint16_t)(bend + 8192);
+    }
+
+    void updateTempoRate() {
+        tempoRateQ16 = (uint32_t)(((uint64_t)tempoCentiBpm << 16) / songTempoCentiBpm);
     }
 
     /*
-      stopSequencer()
-      Stop the sequencer loop.
+      advancePosition()
+      Moves the song position forward by the real time elapsed since the last
+      call, scaled by the tempo rate. Returns the position in ms. Keeping the
+      position incremental (instead of now - start) lets the tempo change
+      mid-song without jumps.
     */
-    void stopSequencer() {
-        sequencerRunning = false;
-        if (debug) Serial.println("[SEQ] stopped");
+    uint32_t advancePosition() {
+        uint32_t nowUs = micros();
+        uint32_t dt = nowUs - lastPositionUs;
+        lastPositionUs = nowUs;
+        uint64_t scaled = (uint64_t)dt * tempoRateQ16 + sequencerPosFrac;
+        sequencerPosUs += scaled >> 16;
+        sequencerPosFrac = (uint16_t)(scaled & 0xFFFF);
+        return (uint32_t)(sequencerPosUs / 1000);
+    }
+
+    ////////////////// MIDI clock output //////////////////
+
+    void sendClockByte(uint8_t b) {
+        clockSink->writeRealtime(b);
     }
 
     /*
-      update()
-      Must be called frequently (typically from the loop()).
-      - processes scheduled noteOffs (voice management)
-      - plays sequencer events at correct times, respecting track loops
-      NOTE: setInstrument() is used when a sequencer event requires an instrument change,
-            but the setInstrument() internal check avoids duplicate Program Change messages.
+      The pulse state (clockRunning, clockNextUs, clockFrac) and clockSink are
+      shared with the esp_timer task and only changed under clockLock; pulses
+      themselves are only sent by the timer task, through the sink it read
+      under the lock.
     */
-    void update() {
-        uint32_t now = millis();
 
-        // Handle scheduled voice offs:
-        for (int v = 0; v < SEQ_MAX_VOICES; v++) {
-            if (voices[v].active && now >= voices[v].offTimeMs) {
-                noteOff(voices[v].channel, (Note)voices[v].note);
-                voices[v].active = false;
-            }
+    // first pulse right away, in phase with the sequencer position
+    void startClock() {
+        if (clockTimer == nullptr) return;
+        esp_timer_stop(clockTimer);
+        portENTER_CRITICAL(&clockLock);
+        clockRunning = true;
+        clockNextUs = micros();
+        clockFrac = 0;
+        portEXIT_CRITICAL(&clockLock);
+        esp_timer_start_once(clockTimer, 1);
+    }
+
+    void stopClock() {
+        portENTER_CRITICAL(&clockLock);
+        clockRunning = false;
+        portEXIT_CRITICAL(&clockLock);
+        if (clockTimer != nullptr) esp_timer_stop(clockTimer);
+    }
+
+    static void clockTimerCallback(void *arg) {
+        static_cast<VS1053_MIDI *>(arg)->clockTick();
+    }
+
+    /*
+      clockTick()
+      Sends one clock pulse and arms the timer for the next one. The period
+      follows the playback tempo (2.5 s / BPM, kept in Q16 so rounding does not
+      accumulate) and is added to the previous deadline rather than to "now",
+      so a late timer callback does not shift the following pulses.
+    */
+    void clockTick() {
+        portENTER_CRITICAL(&clockLock);
+        MidiSink *sink = clockSink;
+        bool running = clockRunning && sink != nullptr;
+        int32_t wait = 0;
+        if (running) {
+            uint64_t period = (((uint64_t)250000000ULL) << 16) / tempoCentiBpm + clockFrac;
+            clockNextUs += (uint32_t)(period >> 16);
+            clockFrac = (uint16_t)(period & 0xFFFF);
+            wait = (int32_t)(clockNextUs - micros());
         }
+        portEXIT_CRITICAL(&clockLock);
+        if (!running) return;
+        sink->writeRealtime(0xF8);
+        if (wait < 1) wait = 1;
+        esp_timer_start_once(clockTimer, (uint64_t)wait);
+    }
 
-        if (!sequencerRunning) return;
+    ////////////////// external clock //////////////////
 
-        // compute elapsed time since sequencer start
-        uint32_t elapsed = now - sequencerStartMs;
+    /*
+      externalPulse(t)
+      One incoming clock pulse at micros() t. A second order PLL predicts each
+      pulse from the last prediction plus the estimated period; the prediction
+      error corrects the phase (gain 2/N) and the period (gain 1/N^2), N being
+      the lock time in pulses. Integer only: the period is kept in Q8 us.
+    */
+    void externalPulse(uint32_t t) {
+        if (extPulses == 0 || (int32_t)(t - extLastPulseUs) <= 0) {
+            // first pulse: nothing to measure yet
+            extPulses = 1;
+            extPredictUs = t;
+        } else if (extPulses == 1) {
+            extPeriodQ8 = (t - extLastPulseUs) << 8;
+            extPulses = 2;
+            extPredictUs = t + (extPeriodQ8 >> 8);
+            extPredictFrac = 0;
+        } else {
+            int32_t err = (int32_t)(t - extPredictUs);
+            int32_t period = (int32_t)(extPeriodQ8 >> 8);
+            if (err > 2 * period || err < -2 * period) {
+                // pulses lost or a tempo jump: measure again from here
+                extPeriodQ8 = (t - extLastPulseUs) << 8;
+                extPulses = 2;
+                extLocked = false;
+                extPredictUs = t + (extPeriodQ8 >> 8);
+                extPredictFrac = 0;
+            } else {
+                int32_t n = (int32_t)((clockLockMs * 1000) / (uint32_t)(period > 0 ? period : 1));
+                if (n < 2) n = 2;
+                int32_t errQ8 = err * 256;
+                int32_t periodQ8 = (int32_t)extPeriodQ8 + errQ8 / (n * n);
+                if (periodQ8 < 256) periodQ8 = 256;
+                extPeriodQ8 = (uint32_t)periodQ8;
+                int32_t step = extPredictFrac + (int32_t)extPeriodQ8 + (2 * errQ8) / n;
+                extPredictUs += (uint32_t)(step >> 8);
+                extPredictFrac = (uint8_t)(step & 0xFF);
+                extPulses++;
+                if (!extLocked && extPulses > (uint32_t)n && err < period / 8 && err > -period / 8) {
+                    extLocked = true;
+                    if (debug) Serial.printf("[CLK] locked, %u.%02u BPM\n", tempoCentiBpm / 100, tempoCentiBpm % 100);
+                }
+            }
+            // the filtered period is the playback tempo
+            tempoCentiBpm = (uint32_t)((250000000ULL << 8) / extPeriodQ8);
+            updateTempoRate();
+        }
+        extLastPulseUs = t;
 
-        // determine pattern length (either globalLoopMs or longest track)
-        uint32_t patternLength = 0;
-        if (globalLoopMs > 0) patternLength = globalLoopMs;
-        else {
-            for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
-                if (trackLoopLengthMs[t] > patternLength) patternLength = trackLoopLengthMs[t];
+        if (extTransport != 0) {
+            // Start/Continue: the sequencer starts on this pulse
+            bool fromStart = extTransport == 0xFA;
+            extTransport = 0;
+            if (fromStart) startSequencer(globalLoopMs, sequencerLooping);
+            else {
+                seekPosition((uint64_t)extPulseCount * pulseSongUs());
+                sequencerRunning = true;
+                if (clockSink != nullptr) startClock();
             }
-            if (patternLength == 0) patternLength = 1; // avoid div zero
+            lastPositionUs = t;
+            return;
         }
+        if (!sequencerRunning) return;
 
-        uint32_t posInPattern = elapsed % patternLength;
+        extPulseCount++;
+        if (extPulses > 2) correctDrift(t);
+    }
 
-        // Iterate tracks and events, fire events when their timeOffset <= posInPattern
-        for (int t = 0; t < SEQ_MAX_TRACKS; t++) {
-            for (int eidx = 0; eidx < trackEventCount[t]; eidx++) {
-                SeqEvent &ev = tracks[t][eidx];
+    // length of one clock pulse in song time (us at songTempo)
+    uint32_t pulseSongUs() const { return 250000000UL / songTempoCentiBpm; }
 
-                // If event should play this cycle (and not yet played)
-                if (!ev.played && ev.timeOffsetMs <= posInPattern) {
-                    // Use setInstrument() which internally avoids duplicate Program Change
-                    setInstrument(ev.channel, ev.inst);
-                    noteOn(ev.channel, ev.note, ev.velocity);
-                    scheduleVoiceOff(ev.channel, (uint8_t)ev.note, now + ev.durationMs);
-                    ev.played = true;
-                    if (debug) Serial.printf("[SEQ] tr=%d ev=%d PLAY ch=%d note=%d dur=%d @%d\n",
-                                             t, eidx, ev.channel, (uint8_t)ev.note, ev.durationMs, posInPattern);
-                } else if (ev.played && ev.timeOffsetMs > posInPattern) {
-                    // pattern wrapped — reset for next loop cycle
-                    ev.played = false;
-                }
-            }
+    /*
+      correctDrift(t)
+      Compares the sequencer position with the position of the pulse received
+      at t. Small errors bend the tempo rate so they vanish over clockDriftMs;
+      errors over a beat (e.g. a missed Song Position) are fixed with a seek.
+    */
+    void correctDrift(uint32_t t) {
+        advancePosition();
+        int32_t since = (int32_t)(micros() - t);   // the pulse was read this long ago
+        if (since < 0) since = 0;
+        int64_t target = (int64_t)extPulseCount * pulseSongUs()
+                       + (int64_t)(((uint64_t)since * tempoRateQ16) >> 16);
+        int64_t err = target - (int64_t)sequencerPosUs;
+        if (err > (int64_t)pulseSongUs() * 24 || err < -(int64_t)pulseSongUs() * 24) {
+            if (debug) Serial.printf("[CLK] resync (%d us off)\n", (int)err);
+            seekPosition((uint64_t)target);
+            return;
         }
+        if (clockDriftMs == 0) return;
+        int64_t corr = (err << 16) / ((int64_t)clockDriftMs * 1000);
+        int64_t limit = tempoRateQ16 / 4;   // never more than +-25 %
+        if (corr > limit) corr = limit;
+        if (corr < -limit) corr = -limit;
+        tempoRateQ16 = (uint32_t)(tempoRateQ16 + corr);
     }
 
-private:
-    bool debug;
+    // converts a song-time duration (ms at songTempo) to real milliseconds
+    uint32_t scaleDuration(uint32_t ms) const {
+        if (tempoRateQ16 == 0x10000) return ms;
+        return (uint32_t)(((uint64_t)ms << 16) / tempoRateQ16);
+    }
+};
 
-    // sequencer storage
-    SeqEvent tracks[SEQ_MAX_TRACKS][SEQ_MAX_EVENTS];
-    uint16_t trackEventCount[SEQ_MAX_TRACKS];
-    uint32_t trackLoopLengthMs[SEQ_MAX_TRACKS];
+///////////////////// MIDI INPUT (UART) /////////////////////
+/*
+  MidiInput reads a MIDI-IN port (31250 baud UART), parses it with MidiParser
+  and passes the messages through to the VS1053 ("thru"), optionally filtered
+  and with channels remapped. Use it to play the board from an external
+  keyboard:
 
-    // sequencer state
-    bool sequencerRunning;
-    uint32_t sequencerStartMs;
-    uint32_t globalLoopMs;
+    MidiInput midiIn(midi, Serial2);
+    setup(): midiIn.begin(MIDI_IN_RX_PIN);
+    loop():  midiIn.update(); midi.update();
 
-    // active voices
-    ActiveVoice voices[SEQ_MAX_VOICES];
+  The ESP32 UART driver is interrupt driven; begin() lowers the RX FIFO
+  threshold so every byte reaches the driver buffer right away, and update()
+  forwards each message as soon as its last byte has been read. Byte-in to
+  byte-out latency is then well under 1 ms as long as loop() keeps calling
+  update(). feed() injects bytes from any other transport.
+*/
 
-    // last instrument per channel (0..15)
-    // used to avoid sending identical Program Change repeatedly
-    uint8_t lastChannelInstrument[16];
+// message classes for setThruFilter()
+#define MIDI_THRU_NOTES     0x01  // Note On / Note Off
+#define MIDI_THRU_CONTROL   0x02  // Control Change
+#define MIDI_THRU_PROGRAM   0x04  // Program Change
+#define MIDI_THRU_BEND      0x08  // Pitch Bend
+#define MIDI_THRU_PRESSURE  0x10  // Channel and polyphonic aftertouch
+#define MIDI_THRU_SYSEX     0x20  // SysEx
+#define MIDI_THRU_SYSTEM    0x40  // System common and realtime (clock, start, stop, ...)
+#define MIDI_THRU_ALL       0x7F
 
-    ////////////////// low level helpers //////////////////
+/*
+  Called for every message read from the input, before filtering and thru.
+*/
+typedef void (*MidiInputCallback)(const MidiMessage &msg);
 
-    /*
-      writeRegister(addr, high, low)
-      Low-level register write to VS1053 control interface.
-      Blocks until DREQ is asserted to ensure safe transfer.
-    */
-    void writeRegister(uint8_t addr, uint8_t high, uint8_t low) {
-        while (!digitalRead(VS1053_DREQ));
-        digitalWrite(VS1053_CS, LOW);
-        SPI.transfer(0x02);         // SCI write
-        SPI.transfer(addr);
-        SPI.transfer(high);
-        SPI.transfer(low);
-        digitalWrite(VS1053_CS, HIGH);
+class MidiInput {
+public:
+    MidiInput(VS1053_MIDI &m, HardwareSerial &p)
+        : midi(m), port(p), thru(true), thruFilter(MIDI_THRU_ALL & ~MIDI_THRU_SYSTEM),
+          thruChannels(0xFFFF), messageCallback(nullptr)
+    {
+        resetChannelMap();
     }
 
     /*
-      loadPlugin()
-      Loads the minimal plugin data used for realtime MIDI operations.
-      Reads the plugin array from PROGMEM and writes to VS1053 registers.
+      begin(rxPin, txPin)
+      Opens the UART at the MIDI baud rate (31250, 8N1).
     */
-    void loadPlugin() {
-        for (int i = 0; i < 28; ) {
-            uint16_t addr = pgm_read_word(&vs1053_plugin[i++]);
-            uint16_t n    = pgm_read_word(&vs1053_plugin[i++]);
-            while (n--) {
-                uint16_t val = pgm_read_word(&vs1053_plugin[i++]);
-                writeRegister(addr, val >> 8, val & 0xFF);
-            }
-        }
+    void begin(int8_t rxPin, int8_t txPin = -1) {
+        port.begin(31250, SERIAL_8N1, rxPin, txPin);
+#ifdef ESP_ARDUINO_VERSION
+#if ESP_ARDUINO_VERSION >= ESP_ARDUINO_VERSION_VAL(2, 0, 8)
+        port.setRxFIFOFull(1);   // hand every byte to the driver at once (default waits for ~120)
+        port.setRxTimeout(1);
+#endif
+#endif
+        parser.reset();
     }
 
     /*
-      sendMIDI(data)
-      Sends a single MIDI byte to the VS1053's MIDI data interface.
-      Waits for DREQ before each byte to respect device timing.
+      update()
+      Reads all bytes waiting in the UART buffer. Call it from loop(), as often
+      as midi.update().
     */
-    void sendMIDI(uint8_t data) {
-        while (!digitalRead(VS1053_DREQ));
-        digitalWrite(VS1053_DCS, LOW);
-        SPI.transfer(0x00);
-        SPI.transfer(data);
-        digitalWrite(VS1053_DCS, HIGH);
+    void update() {
+        int n = port.available();
+        while (n-- > 0) feed((uint8_t)port.read());
     }
 
     /*
-      talkMIDI(cmd, d1, d2)
-      Sends a MIDI message (cmd d1 d2). For Program Change (0xC0), only cmd+d1 are sent.
+      feed(byte)
+      Parses one input byte and handles a completed message.
     */
-    void talkMIDI(uint8_t cmd, uint8_t d1, uint8_t d2 = 0) {
-        sendMIDI(cmd);
-        sendMIDI(d1);
-        if ((cmd & 0xF0) != 0xC0) sendMIDI(d2); // Program Change is two bytes only
+    void feed(uint8_t b) {
+        switch (parser.feed(b)) {
+            case MidiParseResult::Message: handleMessage(parser.message()); break;
+            case MidiParseResult::SysEx:
+                // a truncated SysEx would arrive damaged: drop it
+                if (thru && (thruFilter & MIDI_THRU_SYSEX) && !parser.sysexTruncated()) {
+                    midi.sendSysEx(parser.sysexData(), parser.sysexLength());
+                }
+                break;
+            default: break;
+        }
     }
 
-    /*
-      scheduleVoiceOff(channel, note, offTimeMs)
-      Finds a free voice slot and schedules when to send Note Off for that note.
-      If no free slot is available, prints a warning (debug mode).
-    */
-    void scheduleVoiceOff(uint8_t channel, uint8_t note, uint32_t offTimeMs) {
-        for (int v = 0; v < SEQ_MAX_VOICES; v++) {
-            if (!voices[v].active) {
-                voices[v].active = true;
-                voices[v].channel = channel;
-                voices[v].note = note;
-                voices[v].offTimeMs = offTimeMs;
-                if (debug) Serial.printf("[VOICE] scheduled off ch=%d note=%d at %u\n", channel, note, offTimeMs);
-                return;
-            }
+    // enable/disable passing input messages to the VS1053 (default: on)
+    void setThru(bool enable) { thru = enable; }
+
+    // message classes passed through (MIDI_THRU_* flags). Default: all but system messages
+    void setThruFilter(uint8_t flags) { thruFilter = flags; }
+
+    // input channels passed through (bit n = channel n). Default: all
+    void setThruChannels(uint16_t mask) { thruChannels = mask; }
+
+    // send messages received on inChannel to outChannel (both 0..15)
+    void setChannelMap(uint8_t inChannel, uint8_t outChannel) { channelMap[inChannel & 0x0F] = outChannel & 0x0F; }
+
+    // every channel back to itself
+    void resetChannelMap() {
+        for (uint8_t c = 0; c < 16; c++) channelMap[c] = c;
+    }
+
+    // register a callback for every received message (nullptr to remove)
+    void onMessage(MidiInputCallback cb) { messageCallback = cb; }
+
+private:
+    VS1053_MIDI &midi;
+    HardwareSerial &port;
+    MidiParser parser;
+    bool thru;
+    uint8_t thruFilter;
+    uint16_t thruChannels;
+    uint8_t channelMap[16];
+    MidiInputCallback messageCallback;
+
+    void handleMessage(const MidiMessage &msg) {
+        if (messageCallback) messageCallback(msg);
+        // clock and transport for a sequencer following an external clock
+        if (msg.status >= 0xF8 && msg.status <= 0xFC) midi.receiveClock(msg.status, micros());
+        else if (msg.status == 0xF2) midi.receiveSongPosition(msg.data1 | (msg.data2 << 7));
+        // notes for recording
+        else if ((msg.status & 0xF0) == 0x90) midi.receiveNoteOn(msg.status & 0x0F, msg.data1, msg.data2);
+        else if ((msg.status & 0xF0) == 0x80) midi.receiveNoteOff(msg.status & 0x0F, msg.data1);
+        if (!thru) return;
+        if (msg.status >= 0xF0) {
+            if (thruFilter & MIDI_THRU_SYSTEM) midi.sendMessage(msg);
+            return;
+        }
+        uint8_t ch = msg.status & 0x0F;
+        if (!(thruChannels & (1 << ch))) return;
+        if (!(thruFilter & messageClass(msg.status))) return;
+        MidiMessage out = msg;
+        out.status = (msg.status & 0xF0) | channelMap[ch];
+        midi.sendMessage(out);
+    }
+
+    // MIDI_THRU_* flag of a channel message
+    static uint8_t messageClass(uint8_t status) {
+        switch (status & 0xF0) {
+            case 0x80: case 0x90: return MIDI_THRU_NOTES;
+            case 0xA0: case 0xD0: return MIDI_THRU_PRESSURE;
+            case 0xB0: return MIDI_THRU_CONTROL;
+            case 0xC0: return MIDI_THRU_PROGRAM;
+            default: return MIDI_THRU_BEND;
         }
-        // fallback: no free voice slot
-        if (debug) Serial.println("[VOICE] WARNING: no free voice slots!");
     }
 };
 
@@ -521,7 +4457,7 @@ private:
 class TrackComposer {
 public:
     TrackComposer(VS1053_MIDI &m, uint8_t t)
-        : midi(m), track(t), cursor(0), defaultInstrument(Instrument::AcousticGrandPiano)
+        : midi(m), track(t), cursor(0), defaultInstrument(Instrument::AcousticGrandPiano), ch(0)
     {
         midi.clearTrack(track);
     }
@@ -532,6 +4468,33 @@ public:
         return *this;
     }
 
+    // MIDI channel of the events added from now on (default 0)
+    TrackComposer& channel(uint8_t c) {
+        ch = c & 0x0F;
+        return *this;
+    }
+
+    // make this a drum track: notes go to DRUM_CHANNEL as one-shot hits
+    TrackComposer& drumTrack() {
+        midi.setDrumTrack(track);
+        ch = DRUM_CHANNEL;
+        return *this;
+    }
+
+    // add a percussion hit, advances cursor by dur
+    TrackComposer& drum(Drum d, uint32_t dur, uint8_t vel = 110) {
+        midi.addDrum(track, cursor, d, vel, dur);
+        cursor += dur;
+        return *this;
+    }
+
+    // several hits at once (e.g. {Drum::BassDrum1, Drum::ClosedHiHat}), advances cursor by dur
+    TrackComposer& drums(std::initializer_list<Drum> hits, uint32_t dur, uint8_t vel = 110) {
+        for (Drum d : hits) midi.addDrum(track, cursor, d, vel, dur);
+        cursor += dur;
+        return *this;
+    }
+
     // add rest (advance cursor by ms)
     TrackComposer& rest(uint32_t ms) {
         cursor += ms;
@@ -541,7 +4504,7 @@ public:
     // add a single note given as string (e.g. "C4", "F#3"), advances cursor by dur
     TrackComposer& note(const char* name, uint32_t dur, uint8_t vel = 110) {
         Note n = parseNote(name);
-        midi.addEvent(track, cursor, 0, defaultInstrument, n, vel, dur);
+        midi.addEvent(track, cursor, ch, defaultInstrument, n, vel, dur);
         cursor += dur;
         return *this;
     }
@@ -550,7 +4513,23 @@ public:
     TrackComposer& chord(std::initializer_list<const char*> notes, uint32_t dur, uint8_t vel = 110) {
         for (auto &s : notes) {
             Note n = parseNote(s);
-            midi.addEvent(track, cursor, 0, defaultInstrument, n, vel, dur);
+            midi.addEvent(track, cursor, ch, defaultInstrument, n, vel, dur);
+        }
+        cursor += dur;
+        return *this;
+    }
+
+    /*
+      chord(symbol, octave, voicing, dur, vel)
+      Adds a chord from its symbol ("Dm7", "A", "Bb/D", ...), root in octave,
+      advances cursor by dur. Voicing::Smooth keeps the chords of this track
+      close to each other (voice-leading).
+    */
+    TrackComposer& chord(const char* symbol, int8_t octave, Voicing voicing, uint32_t dur, uint8_t vel = 110) {
+        uint8_t notes[CHORD_MAX_NOTES];
+        uint8_t count = voicer.voice(symbol, octave, voicing, notes);
+        for (uint8_t i = 0; i < count; i++) {
+            midi.addEvent(track, cursor, ch, defaultInstrument, (Note)notes[i], vel, dur);
         }
         cursor += dur;
         return *this;
@@ -560,12 +4539,36 @@ public:
     TrackComposer& arp(std::initializer_list<const char*> notes, uint32_t step, uint8_t vel = 110) {
         for (auto &s : notes) {
             Note n = parseNote(s);
-            midi.addEvent(track, cursor, 0, defaultInstrument, n, vel, step);
+            midi.addEvent(track, cursor, ch, defaultInstrument, n, vel, step);
             cursor += step;
         }
         return *this;
     }
 
+    // control change at the cursor (e.g. cc(7, 40) for volume); does not advance it
+    TrackComposer& cc(uint8_t controller, uint8_t value) {
+        midi.addControlChange(track, cursor, ch, controller, value);
+        return *this;
+    }
+
+    // pitch bend at the cursor (-8192..8191, 0 = center); does not advance it
+    TrackComposer& bend(int16_t value) {
+        midi.addPitchBend(track, cursor, ch, value);
+        return *this;
+    }
+
+    // channel pressure (aftertouch) at the cursor; does not advance it
+    TrackComposer& pressure(uint8_t value) {
+        midi.addChannelPressure(track, cursor, ch, value);
+        return *this;
+    }
+
+    // tempo change at the cursor; does not advance it
+    TrackComposer& tempo(float bpm) {
+        midi.addTempo(track, cursor, bpm);
+        return *this;
+    }
+
     // return total length of this track in ms
     uint32_t length() const { return cursor; }
 
@@ -574,6 +4577,8 @@ private:
     uint8_t track;
     uint32_t cursor;
     Instrument defaultInstrument;
+    uint8_t ch;
+    ChordVoicer voicer;
 
     // parseNote("C#4", "Bb3", ...) -> Note enum
     Note parseNote(const char* s) {
@@ -611,9 +4616,16 @@ public:
         return TrackComposer(midi, t);
     }
 
-    // play the composed song; loop=true will auto-loop using track lengths
+    // play the composed song; loop=true will auto-loop using track lengths,
+    // loop=false plays it once and then stops (see onEnd())
     void play(bool loop = true) {
-        midi.startSequencer(loop ? 0 : 1); // 0 => auto-loop mode
+        midi.startSequencer(0, loop); // 0 => auto-loop length
+    }
+
+    // register a callback fired when a one-shot playback (play(false)) ends
+    Song& onEnd(SongEndCallback cb) {
+        midi.onSongEnd(cb);
+        return *this;
     }
 
 private: